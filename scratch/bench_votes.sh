@@ -0,0 +1,59 @@
+#!/usr/bin/env bash
+# Compares the query throughput of the vote table with that of the previous emhash8 one on a real read set.
+# Both builds query the same index, and their mappings must be identical.
+#
+# usage: scratch/bench_votes.sh <reference.fa> <reads.fa|fq> [repeats] [index flags..]
+# e.g.   scratch/bench_votes.sh chm13.fa hg002_ont_100k.fq 3 -k=15 --fr
+
+set -euo pipefail
+
+if [ $# -lt 2 ]; then
+    echo "usage: $0 <reference.fa> <reads.fa|fq> [repeats] [index flags..]" >&2
+    exit 1
+fi
+
+ref=$(realpath "$1")
+reads=$(realpath "$2")
+repeats=${3:-3}
+shift $(( $# < 3 ? $# : 3 ))
+
+src=$(cd "$(dirname "$0")/.." && pwd)
+work=${BENCH_DIR:-$src/bench-votes}
+mkdir -p "$work"
+
+build() {   # <dir> <HH_EMHASH8>
+    cmake -S "$src" -B "$work/$1" -DCMAKE_BUILD_TYPE=Release -DHH_EMHASH8="$2" > /dev/null
+    cmake --build "$work/$1" --target Collinearity -j"$(nproc)" > /dev/null
+}
+
+build flat OFF
+build emhash8 ON
+
+"$work/flat/Collinearity" --ref="$ref" --idx="$work/ref" "$@"
+
+# prints the best wall time of the repeats, in seconds
+query() {   # <dir>
+    local best=""
+    for ((r = 0; r < repeats; ++r)); do
+        local start end
+        start=$(date +%s.%N)
+        "$work/$1/Collinearity" --idx="$work/ref" --qry="$reads" --out="$work/$1.out" > /dev/null 2>&1
+        end=$(date +%s.%N)
+        best=$(echo "$start $end $best" | awk '{ t = $2 - $1; if ($3 == "" || t < $3) print t; else print $3 }')
+    done
+    echo "$best"
+}
+
+t_flat=$(query flat)
+t_emhash8=$(query emhash8)
+
+if ! cmp -s "$work/flat.out" "$work/emhash8.out"; then
+    echo "The two vote tables mapped the reads differently." >&2
+    exit 1
+fi
+
+n_reads=$(wc -l < "$work/flat.out")
+echo "reads:   $n_reads"
+echo "emhash8: $t_emhash8 s"
+echo "flat:    $t_flat s"
+awk -v a="$t_emhash8" -v b="$t_flat" 'BEGIN { printf "speedup: %.2fx\n", a / b }'
@@ -9,7 +9,11 @@
 #include "../src/utils.h"
 #include "../src/index.h"
 #include "../src/config.h"
+#include "../src/cqutils.h"
 #include "sdsl/vectors.hpp"
+#include <atomic>
+#include <random>
+#include <thread>
 
 struct rf_config_t : args_t {
     int &n_threads = kwarg("num-threads", "number of threads").set_default(1);
@@ -22,6 +26,9 @@ struct rf_config_t : args_t {
 
 int main(int argc, char *argv[]) {
     fna6();
+    fna7();
+    fna8();
+    fna9();
 }
 
 fn(a0) {
@@ -192,3 +199,117 @@ fn(a6) {
     _verify(n0 == n);
     fin.close();
 }
+
+fn(a7) {
+    const size_t n = 1<<20, M = 1<<14;
+    auto keys = generate_random<u4>(1000, n);
+    auto values = parlay::tabulate(n, [](size_t i) { return (u8)i; });
+
+    cqueue_t<u4> q_keys;
+    cqueue_t<u8> q_values;
+    q_keys.push_back(keys.data(), n);
+    q_values.push_back(values.data(), n);
+
+    log_info("Sorting %zd tuples in blocks of %zd..", n, M);
+    auto buf = malloc(2 * (sizeof(u4) + sizeof(u8)) * M);
+    cq_sort_by_key(q_keys, q_values, M, buf);
+    free(buf);
+
+    _verify(q_keys.size() == n);
+    auto sorted = parlay::tabulate(n, [&](size_t i) {
+        if (keys[q_values[i]] != q_keys[i]) return false;
+        if (i == 0) return true;
+        return q_keys[i-1] < q_keys[i] || (q_keys[i-1] == q_keys[i] && q_values[i-1] < q_values[i]);
+    });
+    _verify(parlay::all_of(sorted, [](bool x) {return x;}));
+}
+
+fn(a8) {
+    // searches from threads outside the parlay pool, as from python with the GIL released, while another thread adds
+    // references and merges them
+    std::vector<char*> argv = {(char*)"test", (char*)"-k=11"};
+    config_t config(argv);
+    dindex_t idx(config);
+    auto random_seq = [](size_t n, int seed) {
+        std::mt19937 gen(seed);
+        std::string s(n, 'A');
+        for (auto &c : s) c = "ACGT"[gen() & 3];
+        return s;
+    };
+    std::vector<std::string> refs;
+    for (int i = 0; i < 8; ++i) refs.push_back(random_seq(20000, i));
+    auto add = [&](int i) {
+        auto name = "ref" + std::to_string(i);
+        idx.add(name, parlay::make_slice(refs[i].data(), refs[i].data() + refs[i].size()));
+    };
+    add(0);
+    idx.merge();
+
+    std::atomic<bool> done{false};
+    std::atomic<size_t> n_queries{0}, n_wrong{0};
+    std::thread writer([&]() {
+        for (int i = 1; i < refs.size(); ++i) {
+            add(i);
+            idx.merge();
+        }
+        done = true;
+    });
+    std::vector<std::thread> readers;
+    for (int t = 0; t < 4; ++t) readers.emplace_back([&, t]() {
+        std::mt19937 gen(100 + t);
+        for (int n = 0; !done || n < 200; ++n) {
+            const size_t pos = gen() % (refs[0].size() - 1000);
+            const auto [header, fwd, p, presence] = idx.search(std::string_view(refs[0]).substr(pos, 1000));
+            if (std::string(header) != "ref0" || !fwd) ++n_wrong;
+            ++n_queries;
+        }
+    });
+    writer.join();
+    for (auto &reader : readers) reader.join();
+    log_info("%zd concurrent queries", n_queries.load());
+    _verify(n_wrong == 0);
+}
+
+fn(a9) {
+    // batches of searches run in parallel, as in DynIndex.query_batch, while a background merge runs parallel code
+    // from its own thread outside the parlay pool
+    std::vector<char*> argv = {(char*)"test", (char*)"-k=11"};
+    config_t config(argv);
+    dindex_t idx(config);
+    auto random_seq = [](size_t n, int seed) {
+        std::mt19937 gen(seed);
+        std::string s(n, 'A');
+        for (auto &c : s) c = "ACGT"[gen() & 3];
+        return s;
+    };
+    std::vector<std::string> refs;
+    for (int i = 0; i < 8; ++i) refs.push_back(random_seq(200000, i));
+    auto add = [&](int i) {
+        auto name = "ref" + std::to_string(i);
+        idx.add(name, parlay::make_slice(refs[i].data(), refs[i].data() + refs[i].size()));
+    };
+    add(0);
+    idx.merge();
+
+    std::mt19937 gen(100);
+    std::vector<std::string_view> batch(256);
+    size_t n_queries = 0, n_wrong = 0;
+    for (int i = 1; i < refs.size(); ++i) {
+        add(i);
+        idx.merge_async();
+        for (auto &q : batch) q = std::string_view(refs[0]).substr(gen() % (refs[0].size() - 1000), 1000);
+        std::vector<std::tuple<const char*, bool, u4, float>> results(batch.size());
+        {
+            std::lock_guard<std::mutex> lock(external_parlay_mutex());
+            parlay::for_each(parlay::iota(batch.size()), [&](size_t j) {
+                results[j] = idx.search(batch[j]);
+            });
+        }
+        for (auto &[header, fwd, p, presence] : results)
+            if (std::string(header) != "ref0" || !fwd) ++n_wrong;
+        n_queries += results.size();
+    }
+    idx.wait_merge();
+    log_info("%zd queries during merges", n_queries);
+    _verify(n_wrong == 0);
+}
@@ -43,5 +43,8 @@ fn(a3);
 fn(a4);
 fn(a5);
 fn(a6);
+fn(a7);
+fn(a8);
+fn(a9);
 
 #endif //COLLINEARITY_TESTS_H
@@ -0,0 +1,96 @@
+#ifndef COLLINEARITY_BLOW5_H
+#define COLLINEARITY_BLOW5_H
+
+#include <thread>
+#include "prelude.h"
+#include "fastx.h"
+#include "../external/slow5lib/include/slow5/slow5.h"
+#include "../external/slow5lib/include/slow5/slow5_mt.h"
+
+/**
+ * Raw signals of a batch of reads, each with what it takes to convert it to picoamperes
+ */
+struct blow5_batch_t {
+    struct scale_t {
+        double digitisation, offset, range;
+    };
+    std::vector<std::string> names;
+    std::vector<std::vector<int16_t>> signals;
+    std::vector<scale_t> scales;
+    inline size_t size() const { return signals.size(); }
+};
+
+/**
+ * Reads a SLOW5/BLOW5 file and hands out batches of records.
+ * Records are fetched and decompressed by slow5lib's multi-threaded batch API in a background thread, so decoding
+ * overlaps with whatever the consumer does with the records.
+ */
+class blow5_reader_t {
+    const std::string filename;
+    const int batch_sz, n_decoders;
+    slow5_file_t *sp = nullptr;
+    bounded_queue_t<blow5_batch_t> batches;
+    std::thread decoder;
+
+    void decode() {
+        slow5_mt_t *mt = slow5_init_mt(n_decoders, sp);
+        if (!mt) log_error("Could not initialize the decoders of %s.", filename.c_str());
+        slow5_batch_t *db = slow5_init_batch(batch_sz);
+        int n;
+        while ((n = slow5_get_next_batch(mt, db, batch_sz)) > 0) {
+            /// the records are reused by the next call, so their signals are copied out
+            blow5_batch_t batch;
+            batch.names.reserve(n), batch.signals.reserve(n), batch.scales.reserve(n);
+            for (int i = 0; i < n; ++i) {
+                const slow5_rec_t *rec = db->slow5_rec[i];
+                batch.names.emplace_back(rec->read_id, rec->read_id_len);
+                batch.signals.emplace_back(rec->raw_signal, rec->raw_signal + rec->len_raw_signal);
+                batch.scales.push_back({rec->digitisation, rec->offset, rec->range});
+            }
+            if (!batches.push(std::move(batch))) break;
+        }
+        if (n < 0) log_error("Could not read a batch of records from %s.", filename.c_str());
+        slow5_free_batch(db);
+        slow5_free_mt(mt);
+        batches.close();
+    }
+
+public:
+    /**
+     * Start reading a file
+     * @param filename SLOW5 or BLOW5 file
+     * @param batch_sz number of records per batch
+     * @param n_decoders number of threads that decompress and parse records
+     * @param n_in_flight number of batches that may be read ahead of the consumer
+     */
+    blow5_reader_t(const std::string &filename, int batch_sz, int n_decoders, size_t n_in_flight = 2):
+    filename(filename), batch_sz(batch_sz), n_decoders(std::max(1, n_decoders)), batches(n_in_flight) {
+        sp = slow5_open(filename.c_str(), "r");
+        if (!sp) log_error("Could not open %s.", filename.c_str());
+        decoder = std::thread([this]() { decode(); });
+    }
+
+    blow5_reader_t(const blow5_reader_t&) = delete;
+    blow5_reader_t& operator = (const blow5_reader_t&) = delete;
+
+    ~blow5_reader_t() {
+        batches.close();
+        decoder.join();
+        slow5_close(sp);
+    }
+
+    /**
+     * Get the next batch of records
+     * @return false if there are no more records
+     */
+    inline bool next(blow5_batch_t &batch) { return batches.pop(batch); }
+};
+
+/**
+ * Whether a file name looks like SLOW5/BLOW5
+ */
+static inline bool is_slow5_filename(const std::string &filename) {
+    return str_endswith(filename.c_str(), ".blow5") || str_endswith(filename.c_str(), ".slow5");
+}
+
+#endif //COLLINEARITY_BLOW5_H
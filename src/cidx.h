@@ -0,0 +1,224 @@
+#ifndef COLLINEARITY_CIDX_H
+#define COLLINEARITY_CIDX_H
+
+#include <vector>
+#include "prelude.h"
+#include "parlay_utils.h"
+#include "mmfile.h"
+#include "xxhash.h"
+
+/**
+ * The .cidx container.
+ * The first page holds a header and a table of sections, each section starts at a page boundary.
+ * A section is identified by its id, so loaders can seek straight to the sections they need.
+ */
+#define CIDX_MAGIC              "COLLIDX"
+#define CIDX_VERSION            7
+#define CIDX_BYTE_ORDER         0x01020304U
+#define CIDX_MAX_SECTIONS       64
+#define CIDX_CHECKSUM_CHUNKSZ   (16 MiB)
+
+enum cidx_section_id_t : u4 {
+    SEC_CONFIG = 1,
+    SEC_HEADERS,
+    SEC_OFFSETS,
+    SEC_VALUES,
+    SEC_STATS,
+    SEC_FRAGMENTS,
+    SEC_C_OFFSETS,
+    SEC_C_VALUES,
+    SEC_EF_OFFSETS,
+    SEC_REF_LENGTHS,
+    SEC_PACKED_VALUES,
+    SEC_BLOCK_SKIPS,
+    SEC_VARBYTE_VALUES,
+};
+
+static const char* cidx_section_name(u4 id) {
+    switch (id) {
+        case SEC_CONFIG: return "config";
+        case SEC_HEADERS: return "headers";
+        case SEC_OFFSETS: return "offsets";
+        case SEC_VALUES: return "values";
+        case SEC_STATS: return "stats";
+        case SEC_FRAGMENTS: return "fragments";
+        case SEC_C_OFFSETS: return "compressed offsets";
+        case SEC_C_VALUES: return "compressed values";
+        case SEC_EF_OFFSETS: return "elias-fano offsets";
+        case SEC_REF_LENGTHS: return "reference lengths";
+        case SEC_PACKED_VALUES: return "packed values";
+        case SEC_BLOCK_SKIPS: return "block skips";
+        case SEC_VARBYTE_VALUES: return "varbyte values";
+        default: return "unknown";
+    }
+}
+
+struct cidx_header_t {
+    char magic[8];
+    u4 version;
+    u4 byte_order;
+    u4 n_sections;
+    u4 reserved;
+};
+
+struct cidx_section_t {
+    u4 id;
+    u4 flags;
+    u8 offset;
+    u8 size;
+    u8 checksum;
+};
+
+static_assert(sizeof(cidx_header_t) + CIDX_MAX_SECTIONS * sizeof(cidx_section_t) <= PAGE_SZ,
+              "the section table must fit in the first page");
+
+/**
+ * Checksum of a section.
+ * The section is hashed in fixed-size chunks in parallel and the chunk hashes are hashed again.
+ */
+static u8 cidx_checksum(const char *data, size_t size) {
+    const size_t n_chunks = (size + CIDX_CHECKSUM_CHUNKSZ - 1) / CIDX_CHECKSUM_CHUNKSZ;
+    auto digests = parlay::tabulate(n_chunks, [&](size_t i) {
+        size_t off = i * CIDX_CHECKSUM_CHUNKSZ;
+        return (u8)XXH64(data + off, MIN(CIDX_CHECKSUM_CHUNKSZ, size - off), 0);
+    });
+    return XXH64(digests.data(), digests.size() * sizeof(u8), size);
+}
+
+class cidx_writer_t {
+    std::string filename;
+    std::ofstream fs;
+    std::vector<cidx_section_t> sections;
+    bool in_section = false;
+public:
+    explicit cidx_writer_t(const std::string &filename) : filename(filename) {
+        fs = std::ofstream(filename, std::ios::binary);
+        if (!fs) throw std::runtime_error("could not open " + filename + " for writing");
+        std::vector<char> placeholder(PAGE_SZ, 0);     /// the header is written by finish()
+        fs.write(placeholder.data(), placeholder.size());
+    }
+
+    /**
+     * Start a new section at the next page boundary
+     * @param id section id
+     * @return the stream to write the section into
+     */
+    std::ofstream& begin(u4 id) {
+        if (in_section) throw std::runtime_error("nested sections are not allowed");
+        if (sections.size() == CIDX_MAX_SECTIONS) throw std::runtime_error("too many sections");
+        dump_padding(fs);
+        sections.push_back({id, 0, (u8)fs.tellp(), 0, 0});
+        in_section = true;
+        return fs;
+    }
+
+    inline std::ofstream& stream() { return fs; }
+
+    void end() {
+        if (!in_section) throw std::runtime_error("no section to end");
+        sections.back().size = (u8)fs.tellp() - sections.back().offset;
+        in_section = false;
+    }
+
+    /**
+     * Compute checksums of all sections and write the header and the section table
+     */
+    void finish() {
+        if (in_section) end();
+        fs.close();
+        if (!fs) throw std::runtime_error("could not write " + filename);
+        {
+            mmap_file_t mf(filename);
+            parlay::for_each(parlay::iota(sections.size()), [&](size_t i) {
+                sections[i].checksum = cidx_checksum(mf.data() + sections[i].offset, sections[i].size);
+            });
+        }
+        cidx_header_t header = {};
+        strncpy(header.magic, CIDX_MAGIC, sizeof(header.magic));
+        header.version = CIDX_VERSION;
+        header.byte_order = CIDX_BYTE_ORDER;
+        header.n_sections = sections.size();
+        std::fstream out(filename, std::ios::binary | std::ios::in | std::ios::out);
+        dump_values(out, header);
+        out.write(reinterpret_cast<const char*>(sections.data()), sections.size() * sizeof(cidx_section_t));
+        out.close();
+        if (!out) throw std::runtime_error("could not write the section table of " + filename);
+    }
+};
+
+class cidx_reader_t {
+    std::string filename;
+    std::shared_ptr<mmap_file_t> file;
+    cidx_header_t header = {};
+    std::vector<cidx_section_t> sections;
+public:
+    explicit cidx_reader_t(const std::string &filename) : filename(filename) {
+        file = std::make_shared<mmap_file_t>(filename);
+        mmap_reader_t f(file);
+        load_values(f, &header);
+        if (strncmp(header.magic, CIDX_MAGIC, sizeof(header.magic)) != 0)
+            throw std::runtime_error(filename + " is not a collinearity index");
+        if (header.byte_order != CIDX_BYTE_ORDER)
+            throw std::runtime_error(filename + " was written on a machine with a different byte order");
+        if (header.version != CIDX_VERSION)
+            throw std::runtime_error(filename + " has format version " + std::to_string(header.version) +
+                                     " but version " + std::to_string(CIDX_VERSION) + " is expected");
+        if (header.n_sections > CIDX_MAX_SECTIONS)
+            throw std::runtime_error(filename + " has a corrupt section table");
+        sections.resize(header.n_sections);
+        f.read(sections.data(), sections.size() * sizeof(cidx_section_t));
+        for (const auto &s : sections)
+            if (s.offset + s.size > file->size())
+                throw std::runtime_error(filename + " is truncated: section " + cidx_section_name(s.id) +
+                                         " ends past the end of the file");
+    }
+
+    inline u4 version() const { return header.version; }
+    inline const std::vector<cidx_section_t>& table() const { return sections; }
+    inline std::shared_ptr<mmap_file_t>& mapping() { return file; }
+
+    inline bool has(u4 id) const {
+        return std::any_of(sections.begin(), sections.end(), [id](const cidx_section_t &s){ return s.id == id; });
+    }
+
+    const cidx_section_t& get(u4 id) const {
+        for (const auto &s : sections) if (s.id == id) return s;
+        throw std::runtime_error(filename + " has no " + cidx_section_name(id) + " section");
+    }
+
+    /**
+     * @return a reader over the memory-mapped section
+     */
+    mmap_reader_t section(u4 id) { return mmap_reader_t(file, get(id).offset); }
+
+    /**
+     * @return a stream positioned at the start of the section, for loaders that need an std::istream
+     */
+    std::ifstream istream(u4 id) {
+        std::ifstream fs(filename, std::ios::binary);
+        fs.seekg(get(id).offset);
+        return fs;
+    }
+
+    /**
+     * Verify the checksums of some or all sections in parallel
+     * @param ids sections to verify, or all sections if empty
+     * @return true if all checksums match
+     */
+    bool verify_checksums(const std::vector<u4> &ids = {}) {
+        auto checked = parlay::filter(parlay::make_slice(sections), [&](const cidx_section_t &s) {
+            return ids.empty() || std::find(ids.begin(), ids.end(), s.id) != ids.end();
+        });
+        auto ok = parlay::map(checked, [&](const cidx_section_t &s) {
+            return cidx_checksum(file->data() + s.offset, s.size) == s.checksum;
+        });
+        bool all_ok = true;
+        for (size_t i = 0; i < checked.size(); ++i) if (!ok[i]) {
+            log_warn("Checksum mismatch in section %s of %s.", cidx_section_name(checked[i].id), filename.c_str());
+            all_ok = false;
+        }
+        return all_ok;
+    }
+};
+
+#endif //COLLINEARITY_CIDX_H
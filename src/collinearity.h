@@ -9,6 +9,8 @@
 #include <vector>
 #include "parlay_utils.h"
 #include "kseq++/kseq++.hpp"
+#include "fastx.h"
+#include "blow5.h"
 #include "cqutils.h"
 #include "index.h"
 #include "rawsignals.h"
@@ -17,7 +19,20 @@
 
 void index_fasta(std::string &fasta_filename, index_t *idx);
 
-void query_fasta(index_t *idx, std::string &asta_filename, int batch_sz, std::string &outfile);
+/**
+ * Index the expected signals of references, which are derived from a pore model and quantized
+ * @param fwd_rev also index the expected signals of the reverse complements
+ */
+void index_fasta_raw(std::string &fasta_filename, std::string &poremodel, index_t *idx, bool fwd_rev);
+
+void query_fasta(index_t *idx, std::string &fasta_filename, int batch_sz, std::string &outfile,
+                 config_t::out_fmt_t out_fmt = config_t::tsv);
+
+/**
+ * Map the raw signals of the reads in a SLOW5/BLOW5 file. Their lengths in the output are numbers of events.
+ */
+void query_blow5(index_t *idx, std::string &blow5_filename, int batch_sz, std::string &outfile,
+                 config_t::out_fmt_t out_fmt = config_t::tsv);
 
 
 #endif //COLLINEARITY_COLLINEARITY_H
@@ -35,36 +35,62 @@
     }
 }
 
+#define SIGNAL_SIGMA 16     /// number of levels signals are quantized to, see BIN_EDGES_16
+
 struct args_t: public argparse::Args {
     std::string &ref = kwarg("ref", "Path of input reference fasta file. If this is not set, then the --idx must be set.").set_default("");
     std::string &idx = kwarg("idx", "Base path to output index file (a .cidx suffix will be added to the path). "
                                      "If --idx and --qry are not provided, the --ref path is used to dump the index."
                                      "If this is not set, then the --ref file must be set."
                                      "This is ignored if --ref path is provided.").set_default("");
-    std::string &qry = kwarg("qry", "Path to query fasta. If not provided, then the index is build and dumped to file.").set_default("");
+    std::string &qry = kwarg("qry", "Path to query fasta/fastq, or slow5/blow5 with raw signals. If not provided, then the index is build and dumped to file.").set_default("");
     std::string &out = kwarg("out", "Path to output file. Must be provided if --qry is provided.").set_default("");
+    std::string &out_fmt = kwarg("out-fmt", "Output format: tsv, paf, or bin (fixed-size binary records).").set_default("tsv");
+    int &batch_size = kwarg("batch-size", "Number of query sequences that are searched together.").set_default(4096);
     int &k = kwarg("k", "k-mer length").set_default(15);
+    std::string &pore_model = kwarg("pore-model", "Path to a pore model (k-mer and level_mean per line). If set, references are converted to expected signals and a signal index over quantized events is built, which is queried with slow5/blow5 files.").set_default("");
     bool &jaccard = flag("jaccard", "Use jaccard similarity.");
-    bool &compressed = flag("compressed", "Use a compressed jaccard index.");
+    bool &compressed = flag("compressed", "Use a compressed index. A coordinate index stores its posting lists varbyte coded in blocks, which is slower to search but much smaller.");
     bool &fwd_rev = flag("fr", "Index both forward and reverse strands of the reference.");
+    bool &canonical = flag("canonical", "Store each k-mer of a coordinate index once as the smaller of it and its reverse complement, so that both strands are searched from one set of postings. Like --fr at half the size.");
     float &presence_fraction = kwarg("pf", "Fraction of k-mers that must be present in an alignment.").set_default(0.1f);
     std::string &sort_block_size = kwarg("sort-blksz", "Block size to use in sorting.").set_default("");
+    std::string &build_mem = kwarg("build-mem", "Memory budget for buffered k-mers while indexing, e.g. 16G. Beyond it, sorted runs are spilled to --tmp-dir.").set_default("");
+    std::string &tmp_dir = kwarg("tmp-dir", "Directory for temporary files. Defaults to $TMPDIR or /tmp.").set_default("");
+    std::string &sampling = kwarg("sampling", "K-mers stored in and looked up from a coordinate index: all of them (none), minimizers (minimizer), or open/closed syncmers (open-syncmer, closed-syncmer).").set_default("none");
+    int &sampling_w = kwarg("w", "If --sampling is minimizer, one k-mer is sampled from every window of this many consecutive k-mers.").set_default(10);
+    int &syncmer_s = kwarg("s", "If --sampling is a syncmer scheme, the length of the s-mers that select a k-mer.").set_default(5);
+    float &occ_pct = kwarg("occ-pct", "Percentile of posting list lengths that is stored in the index as its occurrence threshold.").set_default(99.0f);
+    int &max_occ = kwarg("max-occ", "Occurrence threshold to use instead of the one stored in the index (0 to use the stored one).").set_default(0);
+    bool &mask_occ = flag("mask-occ", "Skip k-mers that occur more often than the occurrence threshold when searching.");
+    bool &drop_occ = flag("drop-occ", "Drop k-mers that occur more often than the occurrence threshold from the index when building it.");
+    bool &ef_offsets = flag("ef-offsets", "Store the offsets of the posting lists of a coordinate or jaccard index Elias-Fano coded, only for the k-mers that occur, which shrinks them several-fold in the index file and when it is loaded. They are encoded from the sorted k-mers, so the build never holds the dense offsets of 8 * 4^k bytes (8 GiB at k=15, 32 GiB at k=16), except with --counting-sort, which counts into them.");
+    bool &counting_sort = flag("counting-sort", "Build the index by counting k-mers and scattering values into place instead of sorting them.");
     int &bandwidth = kwarg("bw", "Width of the band in which kmers contained will be considered collinear").set_default(15);
     int &jc_frag_len = kwarg("jc-frag-len", "If --jaccard is set, the sequence are indexed and queried in overlapping fragments of this length.").set_default(180);
     int &jc_frag_ovlp_len = kwarg("jc-frag-ovlp-len", "If --jaccard is set, the sequence are indexed and queried in fragments which overlap this much.").set_default(120);
     bool &dynamic = flag("dynamic", "use a dynamic multi-map");
     int &n_shard_bits = kwarg("num-shard-bits", "log2(x), where x is the number of shards").set_default(10);
     int &n_threads = kwarg("n_threads", "Number of threads to use (set <=0 to use all cores)").set_default(0);
+    bool &inspect = flag("inspect", "Print the layout of the index at --idx and exit.");
+    bool &verify_index = flag("verify-index", "Verify the checksums of the whole index file when loading or inspecting it.");
 };
 
 struct config_t {
-    enum phase_t {index, query, both};
-    phase_t phase;
-    std::string ref, idx, qry, out;
-    int sigma=4, k, bandwidth, jc_frag_len, jc_frag_ovlp_len, n_shard_bits, n_threads;
+    enum phase_t {index, query, both, inspect};
+    enum sampling_t {no_sampling, minimizer, open_syncmer, closed_syncmer};
+    enum out_fmt_t {tsv, paf, bin};
+    phase_t phase = index;
+    sampling_t sampling = no_sampling;
+    out_fmt_t out_fmt = tsv;
+    std::string ref, idx, qry, out, pore_model;
+    int sigma=4, k, bandwidth, jc_frag_len, jc_frag_ovlp_len, n_shard_bits, n_threads, sampling_w = 10, syncmer_s = 5, batch_size = 4096;
     float presence_fraction;
-    bool jaccard, compressed, fwd_rev, dynamic;
-    u8 sort_block_size;
+    bool jaccard, compressed, fwd_rev, dynamic, canonical = false, verify_index = false, counting_sort = false, mask_occ = false, drop_occ = false, ef_offsets = false;
+    float occ_pct = 99;
+    u4 max_occ = 0;
+    u8 sort_block_size, build_mem = 0;
+    std::string tmp_dir = "/tmp";
 
     config_t() = default;
 
@@ -77,26 +103,73 @@ struct config_t {
 
     void dump_to(std::ostream &f) {
         dump_values(f, k, bandwidth, jc_frag_len, jc_frag_ovlp_len, n_shard_bits, n_threads, presence_fraction,
-                    jaccard, compressed, fwd_rev, dynamic, sort_block_size);
+                    jaccard, compressed, fwd_rev, dynamic, sort_block_size, sampling, sampling_w, syncmer_s, sigma, canonical);
     }
 
-    void load_from(std::istream &f) {
+    template <typename Stream>
+    void load_from(Stream &f) {
         load_values(f, &k, &bandwidth, &jc_frag_len, &jc_frag_ovlp_len, &n_shard_bits, &n_threads, &presence_fraction,
-                    &jaccard, &compressed, &fwd_rev, &dynamic, &sort_block_size);
+                    &jaccard, &compressed, &fwd_rev, &dynamic, &sort_block_size, &sampling, &sampling_w, &syncmer_s, &sigma, &canonical);
     }
 
 private:
     void init_from_args(args_t &args, bool validate) {
-        ref = args.ref, idx = args.idx, qry = args.qry, out = args.out;
+        ref = args.ref, idx = args.idx, qry = args.qry, out = args.out, batch_size = args.batch_size;
         k=args.k, bandwidth=args.bandwidth, jc_frag_len=args.jc_frag_len, jc_frag_ovlp_len=args.jc_frag_ovlp_len,
         n_shard_bits=args.n_shard_bits, n_threads=args.n_threads;
         presence_fraction=args.presence_fraction;
         jaccard=args.jaccard, compressed=args.compressed, fwd_rev=args.fwd_rev, dynamic=args.dynamic;
+        canonical=args.canonical;
+        verify_index=args.verify_index, counting_sort=args.counting_sort;
+        if (args.inspect) phase = config_t::phase_t::inspect;
+        if (args.sampling == "none") sampling = no_sampling;
+        else if (args.sampling == "minimizer") sampling = minimizer;
+        else if (args.sampling == "open-syncmer") sampling = open_syncmer;
+        else if (args.sampling == "closed-syncmer") sampling = closed_syncmer;
+        else log_error("Unknown sampling scheme %s.", args.sampling.c_str());
+        sampling_w = args.sampling_w, syncmer_s = args.syncmer_s;
+        if (args.out_fmt == "tsv") out_fmt = tsv;
+        else if (args.out_fmt == "paf") out_fmt = paf;
+        else if (args.out_fmt == "bin") out_fmt = bin;
+        else log_error("Unknown output format %s.", args.out_fmt.c_str());
+        ef_offsets = args.ef_offsets;
+        if (k < 1 || k > MAX_K) log_error("k must be between 1 and %d, build with -DWIDE_KMERS=ON for k up to 21.", MAX_K);
+        if (k > 16) {
+            /// only the sparse offsets scale to 4^k keys
+            if (dynamic || (jaccard && compressed)) log_error("k > 16 only applies to a coordinate or an uncompressed jaccard index.");
+            if (counting_sort) log_error("--counting-sort counts into dense offsets, so it does not apply to k > 16.");
+            if (!ef_offsets) log_info("k > 16, so the offsets are stored Elias-Fano coded.");
+            ef_offsets = true;
+        }
+        pore_model = args.pore_model;
+        if (!pore_model.empty()) {
+            sigma = SIGNAL_SIGMA;
+            if (k > 7) log_error("k must be at most 7 for a signal index because its offsets are dense over 16^k keys.");
+            if (jaccard || dynamic) log_error("--pore-model only applies to a coordinate index.");
+            if (sampling != no_sampling) log_warn("--sampling does not apply to a signal index.");
+            if (compressed) log_warn("--compressed does not apply to a signal index.");
+            sampling = no_sampling, compressed = false;
+        }
+        if (canonical) {
+            if (jaccard || dynamic || !pore_model.empty()) log_error("--canonical only applies to a coordinate index of sequences.");
+            if (fwd_rev) log_info("--canonical searches both strands, so --fr is ignored.");
+            fwd_rev = false;
+        }
+        occ_pct = args.occ_pct, max_occ = MAX(args.max_occ, 0), mask_occ = args.mask_occ, drop_occ = args.drop_occ;
+        if (occ_pct <= 0 || occ_pct > 100) log_error("--occ-pct must be in (0, 100].");
+        if (batch_size < 1) log_error("--batch-size must be positive.");
+        if (sampling == minimizer && sampling_w < 1) log_error("--w must be positive.");
+        if ((sampling == open_syncmer || sampling == closed_syncmer) && (syncmer_s < 1 || syncmer_s >= k))
+            log_error("--s must be between 1 and k-1.");
+        if (sampling != no_sampling && (jaccard || dynamic)) log_warn("--sampling only applies to a coordinate index.");
 
         if (args.n_threads > 0) setenv("PARLAY_NUM_THREADS", std::to_string(args.n_threads).c_str(), 1);
         if (args.sort_block_size.empty()) sort_block_size = MEMPOOL_BLOCKSZ;
         else sort_block_size = hmsize2bytes(args.sort_block_size);
         sort_block_size = (sort_block_size < MEMPOOL_BLOCKSZ)? MEMPOOL_BLOCKSZ : sort_block_size;
+        if (!args.build_mem.empty()) build_mem = hmsize2bytes(args.build_mem);
+        if (!args.tmp_dir.empty()) tmp_dir = args.tmp_dir;
+        else if (getenv("TMPDIR")) tmp_dir = getenv("TMPDIR");
 
         if (validate and !is_valid()) {
             args.help(); exit(1);
@@ -105,6 +178,14 @@ private:
     }
 
     bool is_valid() {
+        if (phase == config_t::phase_t::inspect) {
+            if (idx.empty()) {
+                log_warn("Missing argument: `idx`");
+                return false;
+            }
+            idx = idx + ".cidx";
+            return true;
+        }
         if (!ref.empty() && !qry.empty()) {
             phase = config_t::phase_t::both;
             idx = "";
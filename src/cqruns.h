@@ -0,0 +1,182 @@
+#ifndef COLLINEARITY_CQRUNS_H
+#define COLLINEARITY_CQRUNS_H
+
+#include <unistd.h>
+#include "prelude.h"
+#include "cqueue.h"
+#include "cqutils.h"
+#include "mmfile.h"
+
+/**
+ * Sorted (key, value) runs spilled to disk.
+ * Used to build an index within a memory budget: whenever the in-memory queues grow past the budget they are sorted
+ * and written out as a run, and at the end all runs are memory-mapped and merged in a single multi-way pass.
+ * @tparam K key type
+ * @tparam V value type
+ */
+template <typename K, typename V>
+class cq_runs_t {
+    std::string dir;
+    std::vector<std::string> filenames;
+    size_t n_tuples = 0;
+
+    std::string make_filename(const char *suffix) const {
+        return dir + "/collinearity." + std::to_string(getpid()) + "." + std::to_string((uintptr_t)this) + "." + suffix;
+    }
+
+public:
+    cq_runs_t() = default;
+    cq_runs_t(const cq_runs_t&) = delete;
+    cq_runs_t& operator = (const cq_runs_t&) = delete;
+    ~cq_runs_t() { clear(); }
+
+    void set_dir(const std::string &tmp_dir) { dir = tmp_dir; }
+    inline bool empty() const { return filenames.empty(); }
+    inline size_t size() const { return n_tuples; }
+
+    /**
+     * Sort the queues and write them out as a new run. The queues are empty afterwards.
+     * @param M block size for sorting
+     */
+    void spill(cqueue_t<K> &keys, cqueue_t<V> &values, const size_t M) {
+        expect(keys.size() == values.size());
+        if (keys.empty()) return;
+        const size_t n = keys.size();
+        auto buf = malloc(2 * (sizeof(K) + sizeof(V)) * M);
+        cq_sort_by_key(keys, values, M, buf);
+        free(buf);
+
+        filenames.push_back(make_filename(("run" + std::to_string(filenames.size())).c_str()));
+        std::ofstream fs(filenames.back(), std::ios::binary);
+        if (!fs) log_error("Could not open %s for writing.", filenames.back().c_str());
+        keys.dump(fs);
+        values.dump(fs);
+        fs.close();
+        if (!fs) log_error("Could not write %s.", filenames.back().c_str());
+        keys.clear();
+        values.clear();
+        MEMPOOL_SHRINK(K);
+        MEMPOOL_SHRINK(V);
+        n_tuples += n;
+        log_info("Spilled run %zd with %zd tuples to %s.", filenames.size(), n, filenames.back().c_str());
+    }
+
+    /**
+     * Merge all runs by key. The runs are deleted afterwards.
+     * @param M block size for merging
+     * @param emit called with consecutive chunks of merged keys and values, and their number
+     */
+    template <typename Emit>
+    void merge(const size_t M, Emit emit) {
+        std::vector<std::pair<cqueue_t<K>, cqueue_t<V>>> runs(filenames.size());
+        std::vector<std::shared_ptr<mmap_file_t>> files;
+        for (size_t r = 0; r < filenames.size(); ++r) {
+            files.push_back(std::make_shared<mmap_file_t>(filenames[r]));
+            files.back()->advise(0, files.back()->size(), MADV_SEQUENTIAL);
+            mmap_reader_t f(files.back());
+            runs[r].first.load(f);
+            runs[r].second.load(f);
+        }
+        auto buf = malloc(2 * (sizeof(K) + sizeof(V)) * M);
+        cq_multiway_merge_by_key(runs, M, buf, emit);
+        free(buf);
+        runs.clear();
+        files.clear();
+        clear();
+    }
+
+    /**
+     * Call f on every block of keys of all runs, run by run. Only the keys are read.
+     * @param f called with a pointer to a block of keys and their number
+     */
+    template <typename F>
+    void for_each_key_block(F f) const {
+        for (auto &fn : filenames) {
+            auto file = std::make_shared<mmap_file_t>(fn);
+            file->advise(0, file->size(), MADV_SEQUENTIAL);
+            mmap_reader_t r(file);
+            cqueue_t<K> keys;
+            keys.load(r);
+            keys.for_each_block(f);
+        }
+    }
+
+    /**
+     * Count the tuples of every key of all runs, reading only the keys. The runs are kept.
+     * @param M block size for counting
+     * @param uniq_keys distinct keys, appended in ascending order
+     * @param counts number of tuples with each of them
+     */
+    void count_keys(const size_t M, cqueue_t<K> &uniq_keys, cqueue_t<u4> &counts) const {
+        std::vector<cqueue_t<K>> runs(filenames.size());
+        std::vector<cqueue_t<K>*> run_keys;
+        std::vector<std::shared_ptr<mmap_file_t>> files;
+        for (size_t r = 0; r < filenames.size(); ++r) {
+            files.push_back(std::make_shared<mmap_file_t>(filenames[r]));
+            files.back()->advise(0, files.back()->size(), MADV_SEQUENTIAL);
+            mmap_reader_t f(files.back());
+            runs[r].load(f);
+            run_keys.push_back(&runs[r]);
+        }
+        std::vector<std::vector<size_t>> partitions;
+        cq_get_multiway_merge_partitions(run_keys, M, partitions);
+        std::vector<K> d_keys(M), d_uniq(M);
+        std::vector<u4> d_counts(M);
+        for (auto &take : partitions) {
+            size_t n = 0;
+            for (size_t r = 0; r < runs.size(); ++r) {
+                size_t rc = runs[r].pop_front(d_keys.data() + n, take[r]); expect(rc == take[r]);
+                n += rc;
+            }
+            auto histogram = parlay::histogram_by_key(parlay::make_slice(d_keys.data(), d_keys.data() + n));
+            parlay::sort_inplace(histogram);
+            /// a key can span two partitions, then its count is carried over to the one already written
+            size_t first = 0;
+            if (!histogram.empty() && !uniq_keys.empty() && histogram[0].first == uniq_keys[uniq_keys.size() - 1]) {
+                counts.at(counts.size() - 1) += histogram[0].second;
+                first = 1;
+            }
+            for (size_t i = first; i < histogram.size(); ++i)
+                d_uniq[i - first] = histogram[i].first, d_counts[i - first] = histogram[i].second;
+            uniq_keys.push_back(d_uniq.data(), histogram.size() - first);
+            counts.push_back(d_counts.data(), histogram.size() - first);
+        }
+    }
+
+    /**
+     * Merge all runs into a file of values, grouped by key, in the format written by `cqueue_t::dump`
+     * @param M block size for merging
+     * @param n_kept number of tuples whose key `keep` accepts
+     * @param keep whether the values of a key are written
+     * @return the name of the file, to be removed by the caller
+     */
+    template <typename Keep>
+    std::string merge_values(const size_t M, size_t n_kept, Keep keep) {
+        auto values_filename = make_filename("values");
+        std::ofstream fs(values_filename, std::ios::binary);
+        if (!fs) log_error("Could not open %s for writing.", values_filename.c_str());
+        dump_values(fs, n_kept);
+        dump_padding(fs);
+        merge(M, [&](K *k, V *v, size_t n) {
+            /// the chunk is sorted by key, so the values of a key are written or skipped together
+            for (size_t i = 0, j; i < n; i = j) {
+                for (j = i + 1; j < n && k[j] == k[i]; ++j);
+                if (keep(k[i])) dump_data(fs, v + i, j - i);
+            }
+        });
+        fs.close();
+        if (!fs) log_error("Could not write %s.", values_filename.c_str());
+        return values_filename;
+    }
+
+    /**
+     * Delete all runs
+     */
+    void clear() {
+        for (auto &fn : filenames) unlink(fn.c_str());
+        filenames.clear();
+        n_tuples = 0;
+    }
+};
+
+#endif //COLLINEARITY_CQRUNS_H
@@ -8,6 +8,7 @@
 #include <deque>
 #include "prelude.h"
 #include "mempool.h"
+#include "mmfile.h"
 
 template <typename T>
 struct cqueue_t {
@@ -15,17 +16,20 @@ struct cqueue_t {
         mempool_t<T> &mp;
         T* data = nullptr;
         size_t start = 0, end = 0;
+        bool owned = true;
         block_t(const block_t&) = delete;
         block_t& operator = (const block_t&) = delete;
         block_t(block_t &&other) = default;
         block_t() : mp(mempool_t<T>::getInstance()), data(mp.reserve()) { }
+        /** a read-only block borrowed from elsewhere, e.g. a memory-mapped file */
+        block_t(const T* borrowed, size_t n) : mp(mempool_t<T>::getInstance()), data((T*)borrowed), end(n), owned(false) { }
         ~block_t() {
-            if (data) mp.release(data);
+            if (data && owned) mp.release(data);
             data = nullptr;
         }
 
         /** how many items can I push to the buffer */
-        inline size_t pushable_size() { return MEMPOOL_BLOCKSZ - end; }
+        inline size_t pushable_size() { return owned ? MEMPOOL_BLOCKSZ - end : 0; }
         /** how many items can I pop from the buffer */
         inline size_t poppable_size() { return end - start; }
         /** can I push items into the block? */
@@ -65,12 +69,21 @@ private:
     std::deque<block_t> blocks;
 public:
     typedef T value_type;
+
+    /** A run of elements that are contiguous in memory */
+    struct span_t {
+        const T *data = nullptr;
+        size_t size = 0;
+        inline const T* begin() const { return data; }
+        inline const T* end() const { return data + size; }
+    };
     inline size_t size() const { return _size; }
     inline bool empty() const { return _size == 0; }
     cqueue_t() = default;
     cqueue_t(const cqueue_t<T>&) = delete;
     cqueue_t<T>& operator = (const cqueue_t<T>&) = delete;
     cqueue_t(cqueue_t<T> &&other) = default;
+    cqueue_t<T>& operator = (cqueue_t<T> &&other) = default;
 
     /**
      * Bulk-push elements into the queue.
@@ -128,6 +141,28 @@ public:
         return n_elements - remaining;
     }
 
+    /**
+     * Grow the queue by `n_elements` uninitialized elements, to be filled in through `at`
+     * @param n_elements number of elements
+     */
+    void extend(size_t n_elements) {
+        while (n_elements) {
+            if (blocks.empty() || !blocks.back().is_pushable()) blocks.emplace_back();
+            size_t n = MIN(blocks.back().pushable_size(), n_elements);
+            blocks.back().end += n, n_elements -= n, _size += n;
+        }
+    }
+
+    /**
+     * Visit the blocks of the queue in order
+     * @param f called with a pointer to the first element of a block and the number of elements in it
+     */
+    template <typename F>
+    void for_each_block(F f) const {
+        for (auto &block : blocks)
+            f((const T*)(block.data + block.start), block.end - block.start);
+    }
+
     /**
      * clear the blocks
      */
@@ -151,6 +186,46 @@ public:
         else log_error("Array index out of bounds.");
     }
 
+    /**
+     * Get a pointer to the i-th element of a queue that has not been popped from.
+     * The elements from i to the end of its block are contiguous, see `contiguous_from`.
+     * @param i index
+     * @return a pointer to the element at index i
+     */
+    inline const T* data_at(const size_t i) const {
+        return blocks[MPDIV(i)].data + MPMOD(i);
+    }
+
+    /**
+     * @return the number of elements starting at index i which are contiguous in memory
+     */
+    inline size_t contiguous_from(const size_t i) const {
+        return MEMPOOL_BLOCKSZ - MPMOD(i);
+    }
+
+    /**
+     * Visit the elements in [begin, end) of a queue that has not been popped from as contiguous spans.
+     * The range is split only at block boundaries, so a range no longer than a block yields one or two spans.
+     * @param f called with every span in order
+     */
+    template <typename F>
+    inline void for_each_span(size_t begin, const size_t end, F f) const {
+        while (begin < end) {
+            const size_t n = MIN(end - begin, contiguous_from(begin));
+            f(span_t{data_at(begin), n});
+            begin += n;
+        }
+    }
+
+    /**
+     * Get a writable reference to the i-th element of a queue that has not been popped from
+     * @param i index
+     * @return the element at index i
+     */
+    inline T& at(const size_t i) {
+        return blocks[MPDIV(i)].data[MPMOD(i)];
+    }
+
     class const_iterator {
     private:
         const cqueue_t<T> *q;
@@ -211,14 +286,16 @@ public:
 
     void dump(std::ofstream &fs) {
         dump_values(fs, _size);
+        dump_padding(fs);
         for (auto &block : blocks)
-            dump_data(fs, block.data, block.end - block.start);
+            dump_data(fs, block.data + block.start, block.end - block.start);
     }
 
     void load(std::ifstream &fs) {
         if (_size) log_error("Loading a file into a non-empty queue is not supported.");
         size_t size;
         load_values(fs, &size);
+        load_padding(fs);
         _size = size;
         while (size) {
             size_t rc = std::min(MEMPOOL_BLOCKSZ, size);
@@ -228,6 +305,25 @@ public:
             size -= rc;
         }
     }
+
+    /**
+     * Make this queue a read-only view of a queue dumped into a memory-mapped file.
+     * Nothing is copied; the blocks point straight into the mapping, which must outlive the queue.
+     * @param fs reader positioned where `dump` started writing
+     */
+    void load(mmap_reader_t &fs) {
+        if (_size) log_error("Loading a file into a non-empty queue is not supported.");
+        size_t size;
+        load_values(fs, &size);
+        fs.align();
+        const T* data = fs.template view<T>(size);
+        _size = size;
+        while (size) {
+            size_t rc = std::min(MEMPOOL_BLOCKSZ, size);
+            blocks.emplace_back(data, rc);
+            data += rc, size -= rc;
+        }
+    }
 };
 
 #endif //COLLINEARITY_CQUEUE_H
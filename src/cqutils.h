@@ -10,6 +10,7 @@
 #include "prelude.h"
 #include "cqueue.h"
 #include "parlay_utils.h"
+#include "utils.h"
 
 /**
  * Given a range in a sorted `queue`, find the largest index in the range
@@ -122,80 +123,178 @@ static void cq_get_partitions(cqueue_t<K>& keys, const size_t M, std::vector<siz
     }
 }
 
+/**
+ * Split R sorted runs into merge partitions of at most M elements in total.
+ * Every partition takes a prefix of each run such that all keys in a partition are no larger than the keys
+ * in later partitions, and equal keys are never split across partitions out of run order, so merging the
+ * partitions one after another is stable.
+ * @param runs sorted key runs
+ * @param M max. partition size
+ * @param partitions one vector of per-run sizes for each partition
+ */
 template <typename K>
-static void cq_get_merge_partitions_stable(cqueue_t<K>& keys_A, cqueue_t<K>& keys_B, const size_t M,
-                                     std::vector<std::pair<size_t, size_t>>& partition_sizes) {
-    const size_t nA = keys_A.size(), nB = keys_B.size();
-    size_t offA = 0, offB = 0;
-
-    while (offA < nA && offB < nB) {
-        size_t nPa = MIN(nA - offA, M / 2), nPb = MIN(nB - offB, M / 2);
-
-        if (nPa < M / 2 && nPb < M / 2) {
-            partition_sizes.emplace_back(nPa, nPb);
-            offA += nPa, offB += nPb;
-            break;
+static void cq_get_multiway_merge_partitions(std::vector<cqueue_t<K>*> &runs, const size_t M,
+                                             std::vector<std::vector<size_t>> &partitions) {
+    const size_t R = runs.size();
+    const size_t w = MAX(M / R, 1UL);
+    std::vector<size_t> off(R, 0);
+    while (true) {
+        bool found = false;
+        K m{};
+        for (size_t r = 0; r < R; ++r) {
+            auto &run = *runs[r];
+            if (off[r] == run.size()) continue;
+            K last = run[MIN(off[r] + w, run.size()) - 1];
+            if (!found || last < m) m = last, found = true;
+        }
+        if (!found) break;
+
+        /// every key smaller than the smallest window-end lies within the windows
+        std::vector<size_t> take(R, 0);
+        size_t total = 0;
+        for (size_t r = 0; r < R; ++r) {
+            auto &run = *runs[r];
+            if (off[r] == run.size()) continue;
+            take[r] = cq_lower_bound(run, off[r], MIN(off[r] + w, run.size()), m) - off[r];
+            total += take[r];
         }
 
-        else {
-            K m = MIN(keys_A[offA + nPa - 1], keys_B[offB + nPb - 1]);
-            nPa = cq_lower_bound(keys_A, offA, offA + nPa, m) - offA;
-            nPb = cq_lower_bound(keys_B, offB, offB + nPb, m) - offB;
-            partition_sizes.emplace_back(nPa, nPb);
-            offA += nPa, offB += nPb;
+        /// all heads are equal to or larger than m; take the m's of the first run that starts with m
+        if (!total) {
+            for (size_t r = 0; r < R; ++r) {
+                auto &run = *runs[r];
+                if (off[r] == run.size() || run[off[r]] != m) continue;
+                take[r] = cq_upper_bound(run, off[r], MIN(off[r] + w, run.size()), m) - off[r];
+                break;
+            }
         }
+
+        for (size_t r = 0; r < R; ++r) off[r] += take[r];
+        partitions.push_back(std::move(take));
     }
+}
 
-    if (offA == nA || offB == nB) {
-        if (offA == nA && offB < nB) partition_sizes.emplace_back(0, nB - offB);
-        else if (offB == nB && offA < nA) partition_sizes.emplace_back(nA - offA, 0);
+/**
+ * Stable k-way merge of key-value segments laid out back-to-back in memory.
+ * The output is split into key ranges that are merged in parallel, each with a heap over the segments.
+ * @param keys input keys, segment r occupies [seg_offsets[r], seg_offsets[r+1])
+ * @param values input values
+ * @param seg_offsets R+1 segment boundaries
+ * @param out_keys merged keys
+ * @param out_values merged values
+ */
+template <typename K, typename V>
+static void multiway_merge_by_key(const K *keys, const V *values, const std::vector<size_t> &seg_offsets,
+                                  K *out_keys, V *out_values) {
+    const size_t R = seg_offsets.size() - 1, n = seg_offsets.back();
+    if (!n) return;
+
+    /// pick splitters from the largest segment and cut every segment at them
+    size_t largest = 0;
+    for (size_t r = 1; r < R; ++r)
+        if (seg_offsets[r+1] - seg_offsets[r] > seg_offsets[largest+1] - seg_offsets[largest]) largest = r;
+    const size_t l_start = seg_offsets[largest], l_size = seg_offsets[largest+1] - l_start;
+    const size_t P = MAX(1UL, MIN(parlay::num_workers() * 4, l_size / 1024));
+    std::vector<size_t> cuts((P + 1) * R);
+    for (size_t r = 0; r < R; ++r) {
+        cuts[r] = seg_offsets[r];
+        cuts[P * R + r] = seg_offsets[r+1];
+    }
+    parlay::parallel_for(1, P, [&](size_t p) {
+        K splitter = keys[l_start + p * l_size / P];
+        for (size_t r = 0; r < R; ++r)
+            cuts[p * R + r] = lower_bound(keys, seg_offsets[r], seg_offsets[r+1], splitter);
+    });
+
+    std::vector<size_t> out_offsets(P + 1, 0);
+    for (size_t p = 0; p < P; ++p) {
+        size_t np = 0;
+        for (size_t r = 0; r < R; ++r) np += cuts[(p + 1) * R + r] - cuts[p * R + r];
+        out_offsets[p + 1] = out_offsets[p] + np;
     }
+
+    parlay::parallel_for(0, P, [&](size_t p) {
+        std::vector<size_t> head(cuts.begin() + p * R, cuts.begin() + (p + 1) * R);
+        const size_t *tail = cuts.data() + (p + 1) * R;
+        /// min-heap over (key, run); the run index breaks ties to keep the merge stable
+        std::vector<std::pair<K, size_t>> heap;
+        auto greater = [](const std::pair<K, size_t> &a, const std::pair<K, size_t> &b) { return a > b; };
+        for (size_t r = 0; r < R; ++r) if (head[r] < tail[r]) heap.emplace_back(keys[head[r]], r);
+        std::make_heap(heap.begin(), heap.end(), greater);
+        size_t o = out_offsets[p];
+        while (!heap.empty()) {
+            std::pop_heap(heap.begin(), heap.end(), greater);
+            const size_t r = heap.back().second;
+            /// copy the whole run of keys that doesn't exceed the next smallest head
+            size_t end = tail[r];
+            if (heap.size() > 1) {
+                const auto &next = heap.front();
+                end = (next.second > r) ? upper_bound(keys, head[r], tail[r], next.first)
+                                        : lower_bound(keys, head[r], tail[r], next.first);
+            }
+            for (size_t i = head[r]; i < end; ++i, ++o) out_keys[o] = keys[i], out_values[o] = values[i];
+            head[r] = end;
+            if (head[r] < tail[r]) heap.back().first = keys[head[r]], std::push_heap(heap.begin(), heap.end(), greater);
+            else heap.pop_back();
+        }
+    });
 }
 
-template<typename K, typename V>
-static void cq_merge_by_key(cqueue_t<K> &keys_A, cqueue_t<V> &values_A,
-                            cqueue_t<K> &keys_B, cqueue_t<V> &values_B,
-                            const size_t M, void* d_buf,
-                            cqueue_t<K> &keys_C, cqueue_t<V> &values_C)
-{
-    expect(keys_A.size() == values_A.size());
-    expect(keys_B.size() == values_B.size());
-    expect(keys_C.size() == 0);
-    expect(values_C.size() == 0);
-
-    /// find out the partitions
-    std::vector<std::pair<size_t, size_t>> partition_sizes;
-    cq_get_merge_partitions_stable(keys_A, keys_B, M, partition_sizes);
-
-    /// merge partitions
+/**
+ * Merge sorted runs of key-value pairs in a single pass, M elements at a time.
+ * Runs are drained as they are merged, so memory held by the runs is released as the merge progresses.
+ * @param runs sorted key-value runs
+ * @param M max. number of tuples merged at a time
+ * @param d_buf buffer of size 2 * (sizeof(K) + sizeof(V)) * M
+ * @param emit called with each merged chunk (keys, values, count) in ascending key order
+ */
+template<typename K, typename V, typename Emit>
+static void cq_multiway_merge_by_key(std::vector<std::pair<cqueue_t<K>, cqueue_t<V>>> &runs,
+                                     const size_t M, void *d_buf, Emit emit) {
+    const size_t R = runs.size();
+    std::vector<cqueue_t<K>*> run_keys;
+    for (auto &run : runs) {
+        expect(run.first.size() == run.second.size());
+        run_keys.push_back(&run.first);
+    }
+    std::vector<std::vector<size_t>> partitions;
+    cq_get_multiway_merge_partitions(run_keys, M, partitions);
+    log_debug(LOW, "Merging %zd runs in %zd partitions", R, partitions.size());
+
     auto d_keys = (K*)d_buf;
     auto d_values = (V*)(d_keys + M);
-    for (auto ps : partition_sizes) {
-        size_t nA = ps.first, nB = ps.second, rc;
-        if (nA && nB) {
-            rc = keys_A.pop_front(d_keys, nA); expect(rc == nA);
-            rc = keys_B.pop_front(d_keys + nA, nB); expect(rc == nB);
-            rc = values_A.pop_front(d_values, nA); expect(rc == nA);
-            rc = values_B.pop_front(d_values + nA, nB); expect(rc == nB);
-            sort_by_key(d_keys, d_values, nA + nB);
-            keys_C.push_back(d_keys, nA + nB);
-            values_C.push_back(d_values, nA + nB);
-        }
-        else if (nA) {
-            rc = keys_A.pop_front(keys_C, nA); expect(rc == nA);
-            rc = values_A.pop_front(values_C, nA); expect(rc == nA);
+    auto d_out_keys = (K*)(d_values + M);
+    auto d_out_values = (V*)(d_out_keys + M);
+    std::vector<size_t> seg_offsets(R + 1);
+    for (auto &take : partitions) {
+        seg_offsets[0] = 0;
+        size_t n_runs = 0, last = 0;
+        for (size_t r = 0; r < R; ++r) {
+            size_t rc = runs[r].first.pop_front(d_keys + seg_offsets[r], take[r]); expect(rc == take[r]);
+            rc = runs[r].second.pop_front(d_values + seg_offsets[r], take[r]); expect(rc == take[r]);
+            seg_offsets[r+1] = seg_offsets[r] + take[r];
+            if (take[r]) n_runs++, last = r;
         }
+        const size_t n = seg_offsets[R];
+        if (n_runs == 1) emit(d_keys + seg_offsets[last], d_values + seg_offsets[last], n);
         else {
-            rc = keys_B.pop_front(keys_C, nB); expect(rc == nB);
-            rc = values_B.pop_front(values_C, nB); expect(rc == nB);
+            multiway_merge_by_key(d_keys, d_values, seg_offsets, d_out_keys, d_out_values);
+            emit(d_out_keys, d_out_values, n);
         }
     }
+    for (auto &run : runs) expect(run.first.empty());
 }
 
+/**
+ * Sort key-value pairs in queues by key. Blocks of M pairs are sorted in memory and the sorted runs are then
+ * combined by a single multi-way merge.
+ * @param keys keys, replaced by the sorted keys
+ * @param values values, permuted along with the keys
+ * @param M block size
+ * @param d_buf buffer of size 2 * (sizeof(K) + sizeof(V)) * M
+ */
 template<typename K, typename V>
 static void cq_sort_by_key(cqueue_t<K> &keys, cqueue_t<V> &values, const size_t M, void* d_buf) {
-//    auto keys = *keys_p;
-//    auto values = *values_p;
     const size_t N = keys.size();
     expect(N == values.size());
 
@@ -226,19 +325,16 @@ static void cq_sort_by_key(cqueue_t<K> &keys, cqueue_t<V> &values, const size_t
     else {
         log_debug(LOW, "Sorting blocks..");
         /// sort key-value pairs in chunks of M
-        std::queue<std::pair<cqueue_t<K>, cqueue_t<V>>> sorted;
-        expect(sorted.size() == 0);
+        std::vector<std::pair<cqueue_t<K>, cqueue_t<V>>> sorted;
         while (true) {
             size_t nr = keys.pop_front(d_keys, M);
             size_t nv = values.pop_front(d_values, M);
             expect(nv == nr);
             if (!nr) break;
             sort_by_key(d_keys, d_values, nr);
-            cqueue_t<K> sorted_keys;
-            cqueue_t<V> sorted_values;
-            sorted_keys.push_back(d_keys, nr);
-            sorted_values.push_back(d_values, nr);
-            sorted.emplace(std::move(sorted_keys), std::move(sorted_values));
+            sorted.emplace_back();
+            sorted.back().first.push_back(d_keys, nr);
+            sorted.back().second.push_back(d_values, nr);
         }
         log_debug(LOW, "Created %zd sorted lists", sorted.size());
         expect(keys.size() == 0);
@@ -246,30 +342,10 @@ static void cq_sort_by_key(cqueue_t<K> &keys, cqueue_t<V> &values, const size_t
         PRINT_MEM_USAGE(K);
         PRINT_MEM_USAGE(V);
 
-        int merge_round = 1;
-        while (sorted.size() > 2) {
-            auto kv_pair_left = std::move(sorted.front());
-            sorted.pop();
-            auto kv_pair_right = std::move(sorted.front());
-            sorted.pop();
-            cqueue_t<K> out_keys;
-            cqueue_t<V> out_values;
-            log_debug(LOW, "Merge round %d: %zd + %zd", merge_round++, kv_pair_left.first.size(), kv_pair_right.first.size());
-            cq_merge_by_key(kv_pair_left.first, kv_pair_left.second, kv_pair_right.first, kv_pair_right.second,
-                            M, d_buf, out_keys, out_values);
-            sorted.push(std::make_pair(std::move(out_keys), std::move(out_values)));
-            log_debug(LOW, "Left with %zd sorted lists", sorted.size());
-            PRINT_MEM_USAGE(K);
-            PRINT_MEM_USAGE(V);
-        }
-
-        // last 2 blocks remaining. merge
-        auto kv_pair_left = std::move(sorted.front());
-        sorted.pop();
-        auto kv_pair_right = std::move(sorted.front());
-        sorted.pop();
-        log_debug(LOW, "Final merge round %d: %zd + %zd", merge_round, kv_pair_left.first.size(), kv_pair_right.first.size());
-        cq_merge_by_key(kv_pair_left.first, kv_pair_left.second, kv_pair_right.first, kv_pair_right.second, M, d_buf, keys, values);
+        cq_multiway_merge_by_key(sorted, M, d_buf, [&](K *k, V *v, size_t n) {
+            keys.push_back(k, n);
+            values.push_back(v, n);
+        });
         expect(keys.size() == N);
         expect(values.size() == N);
         PRINT_MEM_USAGE(K);
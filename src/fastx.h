@@ -0,0 +1,254 @@
+#ifndef COLLINEARITY_FASTX_H
+#define COLLINEARITY_FASTX_H
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <zlib.h>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include "prelude.h"
+#include "parlay_utils.h"
+#include "kseq++/kseq++.hpp"
+
+#define FASTX_CHUNKSZ (4 << 20)           /// bytes of decompressed input handed to the parser at once
+#define BGZF_HEADERSZ 18
+#define BGZF_CHUNK_BLOCKS 256             /// BGZF blocks are at most 64 KiB, so chunks are at most 16 MiB
+
+/**
+ * A blocking queue with a fixed capacity, used to hand work from one pipeline stage to the next.
+ * Closing the queue wakes up everyone waiting on it; `pop` then drains what is left and `push` fails.
+ */
+template <typename T>
+class bounded_queue_t {
+    std::mutex mtx;
+    std::condition_variable not_full, not_empty;
+    std::deque<T> items;
+    const size_t capacity;
+    bool closed = false;
+
+public:
+    explicit bounded_queue_t(size_t capacity) : capacity(capacity) {}
+
+    bool push(T &&item) {
+        std::unique_lock<std::mutex> lock(mtx);
+        not_full.wait(lock, [&]() { return closed || items.size() < capacity; });
+        if (closed) return false;
+        items.push_back(std::move(item));
+        not_empty.notify_one();
+        return true;
+    }
+
+    bool pop(T &item) {
+        std::unique_lock<std::mutex> lock(mtx);
+        not_empty.wait(lock, [&]() { return closed || !items.empty(); });
+        if (items.empty()) return false;
+        item = std::move(items.front());
+        items.pop_front();
+        not_full.notify_one();
+        return true;
+    }
+
+    void close() {
+        std::lock_guard<std::mutex> lock(mtx);
+        closed = true;
+        not_full.notify_all();
+        not_empty.notify_all();
+    }
+};
+
+struct fastx_batch_t {
+    std::vector<std::string> names, seqs;
+    inline size_t size() const { return seqs.size(); }
+};
+
+/**
+ * Reads a FASTA/FASTQ file, plain, gzipped or BGZF-compressed, and hands out batches of records.
+ * Decompression and parsing each run in their own thread, connected to each other and to the consumer by bounded
+ * queues, so that both overlap with whatever the consumer does with the records. The blocks of a BGZF file are
+ * independent gzip members, so they are inflated in parallel by the parlay workers.
+ */
+class fastx_reader_t {
+    const std::string filename;
+    const size_t batch_sz;
+    bounded_queue_t<std::string> chunks;
+    bounded_queue_t<fastx_batch_t> batches;
+    std::thread inflater, parser;
+
+    /// the parser's view of the decompressed chunks as a stream of bytes
+    struct chunk_source_t {
+        bounded_queue_t<std::string> &chunks;
+        std::string chunk;
+        size_t pos = 0;
+
+        int read(char *buf, unsigned n) {
+            while (pos == chunk.size()) {
+                if (!chunks.pop(chunk)) return 0;
+                pos = 0;
+            }
+            size_t m = std::min((size_t)n, chunk.size() - pos);
+            memcpy(buf, chunk.data() + pos, m);
+            pos += m;
+            return (int)m;
+        }
+    };
+
+    static bool is_bgzf(const u1 *h, size_t n) {
+        return n >= BGZF_HEADERSZ && h[0] == 0x1f && h[1] == 0x8b && h[2] == 8 && (h[3] & 4) &&
+               h[10] == 6 && h[11] == 0 && h[12] == 'B' && h[13] == 'C' && h[14] == 2 && h[15] == 0;
+    }
+
+    /// size of a BGZF block once inflated, from its gzip trailer
+    static inline u4 bgzf_isize(const u1 *block, size_t block_sz) {
+        return block[block_sz-4] | (block[block_sz-3] << 8) | (block[block_sz-2] << 16) | ((u4)block[block_sz-1] << 24);
+    }
+
+    static void inflate_bgzf_block(const u1 *block, size_t block_sz, char *out) {
+        const u4 isize = bgzf_isize(block, block_sz);
+        z_stream zs = {};
+        if (inflateInit2(&zs, -15) != Z_OK) log_error("Could not initialize zlib.");
+        zs.next_in = (Bytef*)block + BGZF_HEADERSZ;
+        zs.avail_in = block_sz - BGZF_HEADERSZ - 8;
+        zs.next_out = (Bytef*)out;
+        zs.avail_out = isize;
+        int ret = inflate(&zs, Z_FINISH);
+        inflateEnd(&zs);
+        if (ret != Z_STREAM_END || zs.total_out != isize) log_error("Corrupt BGZF block.");
+    }
+
+    /// read up to BGZF_CHUNK_BLOCKS blocks, inflate them in parallel and push them as one chunk
+    void inflate_bgzf(int fd, std::vector<u1> &pending) {
+        std::vector<u1> buf = std::move(pending);
+        bool eof = false;
+        while (true) {
+            std::vector<std::pair<size_t, size_t>> blocks;   /// offset and size in buf
+            size_t pos = 0;
+            while (blocks.size() < BGZF_CHUNK_BLOCKS) {
+                if (buf.size() - pos < BGZF_HEADERSZ || buf.size() - pos < (size_t)(buf[pos+16] | (buf[pos+17] << 8)) + 1) {
+                    if (eof) break;
+                    size_t old = buf.size();
+                    buf.resize(old + FASTX_CHUNKSZ);
+                    ssize_t n = ::read(fd, buf.data() + old, FASTX_CHUNKSZ);
+                    if (n < 0) log_error("Could not read %s because %s.", filename.c_str(), strerror(errno));
+                    buf.resize(old + n);
+                    eof = (n == 0);
+                    continue;
+                }
+                if (!is_bgzf(buf.data() + pos, buf.size() - pos)) log_error("Corrupt BGZF file %s.", filename.c_str());
+                size_t block_sz = (buf[pos+16] | (buf[pos+17] << 8)) + 1;
+                blocks.emplace_back(pos, block_sz);
+                pos += block_sz;
+            }
+            if (blocks.empty()) {
+                if (pos != buf.size()) log_error("Truncated BGZF file %s.", filename.c_str());
+                return;
+            }
+
+            /// the trailers give the inflated sizes, so every block is inflated straight to its place in the chunk
+            auto offsets = parlay::tabulate(blocks.size(), [&](size_t i) -> size_t {
+                return bgzf_isize(buf.data() + blocks[i].first, blocks[i].second);
+            });
+            const size_t total = parlay::scan_inplace(offsets);
+            std::string chunk(total, 0);
+            parlay::parallel_for(0, blocks.size(), [&](size_t i) {
+                inflate_bgzf_block(buf.data() + blocks[i].first, blocks[i].second, chunk.data() + offsets[i]);
+            }, 1);
+            if (!chunk.empty() && !chunks.push(std::move(chunk))) return;
+
+            /// the next chunk starts at the beginning of the buffer
+            buf.erase(buf.begin(), buf.begin() + pos);
+        }
+    }
+
+    void inflate_stream() {
+        int fd = open(filename.c_str(), O_RDONLY);
+        if (fd < 0) log_error("Could not open %s because %s.", filename.c_str(), strerror(errno));
+        std::vector<u1> head(BGZF_HEADERSZ);
+        ssize_t n = ::read(fd, head.data(), BGZF_HEADERSZ);
+        if (n < 0) log_error("Could not read %s because %s.", filename.c_str(), strerror(errno));
+        head.resize(n);
+        if (is_bgzf(head.data(), head.size())) {
+            inflate_bgzf(fd, head);
+            close(fd);
+        } else {
+            /// gzread reads both gzipped and plain files
+            lseek(fd, 0, SEEK_SET);
+            gzFile fp = gzdopen(fd, "r");
+            if (!fp) log_error("Could not open %s.", filename.c_str());
+            gzbuffer(fp, 1 << 20);
+            while (true) {
+                std::string chunk(FASTX_CHUNKSZ, 0);
+                int m = gzread(fp, chunk.data(), FASTX_CHUNKSZ);
+                if (m < 0) log_error("Could not decompress %s.", filename.c_str());
+                if (m == 0) break;
+                chunk.resize(m);
+                if (!chunks.push(std::move(chunk))) break;
+            }
+            gzclose(fp);
+        }
+        chunks.close();
+    }
+
+    void parse() {
+        using namespace klibpp;
+        chunk_source_t source{chunks};
+        auto ks = make_kstream(&source, [](chunk_source_t *s, void *buf, unsigned n) {
+            return s->read((char*)buf, n);
+        }, mode::in);
+        KSeq record;
+        fastx_batch_t batch;
+        while (ks >> record) {
+            batch.names.emplace_back(std::move(record.name));
+            batch.seqs.emplace_back(std::move(record.seq));
+            if (batch.size() == batch_sz) {
+                if (!batches.push(std::move(batch))) break;
+                batch = fastx_batch_t();
+            }
+        }
+        if (batch.size()) batches.push(std::move(batch));
+        batches.close();
+        chunks.close();
+    }
+
+public:
+    /**
+     * Start reading a file
+     * @param filename FASTA/FASTQ file, optionally gzipped or BGZF-compressed
+     * @param batch_sz number of records per batch
+     * @param n_in_flight number of batches that may be read ahead of the consumer
+     */
+    fastx_reader_t(const std::string &filename, size_t batch_sz, size_t n_in_flight = 4):
+    filename(filename), batch_sz(batch_sz), chunks(n_in_flight), batches(n_in_flight) {
+        inflater = std::thread([this]() { inflate_stream(); });
+        parser = std::thread([this]() { parse(); });
+    }
+
+    fastx_reader_t(const fastx_reader_t&) = delete;
+    fastx_reader_t& operator = (const fastx_reader_t&) = delete;
+
+    ~fastx_reader_t() {
+        batches.close();
+        chunks.close();
+        parser.join();
+        inflater.join();
+    }
+
+    /**
+     * Get the next batch of records
+     * @return false if there are no more records
+     */
+    inline bool next(fastx_batch_t &batch) { return batches.pop(batch); }
+};
+
+/**
+ * Whether a file name looks like FASTA/FASTQ, optionally gzipped
+ */
+static inline bool is_fastx_filename(std::string filename) {
+    if (filename.size() > 3 && str_endswith(filename.c_str(), ".gz")) filename.resize(filename.size() - 3);
+    for (const char *ext: {".fa", ".fasta", ".fna", ".fq", ".fastq"})
+        if (filename.size() > strlen(ext) && str_endswith(filename.c_str(), ext)) return true;
+    return false;
+}
+
+#endif //COLLINEARITY_FASTX_H
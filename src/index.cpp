@@ -3,9 +3,12 @@
 //
 #include "collinearity.h"
 #include "index.h"
+#include "vbyte.h"
 
+using namespace std;
 
-// I am assuming that the number of sequences won't exceed 2^20 (1M)
+
+// The dynamic index assumes that the number of sequences won't exceed 2^20 (1M)
 // and the longest sequence won't be longer than 2^40 (1T)
 // if that's not the case, change the following line accordingly
 #define ref_id_nbits 20
@@ -15,26 +18,80 @@
 #define get_id_from(key) ((key) >> ref_len_nbits)
 #define get_pos_from(key) ((key) & ref_id_bitmask)
 
-static void dump_headers(std::ostream &fs, std::vector<std::string> &headers);
-static void load_headers(std::istream &fs, std::vector<std::string> &headers);
+// The coordinate index stages coordinates in 64 bits while references are added, and packs them to the widths the
+// references actually need when it is built. A vote key takes the packed layout with one more bit for the strand, so
+// the staged widths leave room for it.
+#define coord_pos_nbits 40
+#define coord_max_refs (1ULL << 23)
+#define make_coord(id, pos) (((u8)(id)) << coord_pos_nbits | (pos))
+#define coord_id(c) ((c) >> coord_pos_nbits)
+#define coord_pos(c) ((c) & ((1ULL << coord_pos_nbits) - 1))
+
+// how many seeds ahead of the one being processed to prefetch in search
+#define SEARCH_PREFETCH_DIST 16
+
+static void dump_headers(cidx_writer_t &fs, std::vector<std::string> &headers, std::vector<u8> &lengths);
+static void load_headers(cidx_reader_t &fs, std::vector<std::string> &headers, std::vector<u8> &lengths);
+static void dump_offsets(cidx_writer_t &fs, parlay::sequence<u8> &offsets, ef_offsets_t &ef_offsets);
+static void map_offsets(cidx_reader_t &fs, const u8 *&offsets, ef_offsets_t &ef_offsets);
 template <typename V>
-static void dump_coordinates(std::ostream &fs, parlay::sequence<u8> &offsets, cqueue_t<V> &values);
+static void dump_coordinates(cidx_writer_t &fs, parlay::sequence<u8> &offsets, ef_offsets_t &ef_offsets, cqueue_t<V> &values);
 template <typename V>
-static void load_coordinates(std::istream &fs, parlay::sequence<u8> &offsets, cqueue_t<V> &values);
+static void map_coordinates(cidx_reader_t &fs, const u8 *&offsets, ef_offsets_t &ef_offsets, cqueue_t<V> &values);
 
 template <typename K, typename V>
-static u4 consolidate(cqueue_t<K> &q_keys, cqueue_t<V> &q_values, parlay::sequence<u8> &value_offsets, u4 block_sz);
+static u4 consolidate(cqueue_t<K> &q_keys, cqueue_t<V> &q_values, parlay::sequence<u8> &value_offsets, u4 block_sz, float occ_pct);
+template <typename K, typename V>
+static u4 consolidate_by_counting(cqueue_t<K> &q_keys, cqueue_t<V> &q_values, parlay::sequence<u8> &value_offsets, u4 block_sz, float occ_pct);
+template <typename V>
+static void drop_overfull_lists(cqueue_t<V> &values, parlay::sequence<u8> &value_offsets, u8 limit);
+template <typename K, typename V>
+static u4 consolidate_runs(cq_runs_t<K, V> &runs, cqueue_t<K> &q_keys, cqueue_t<V> &q_values,
+                           parlay::sequence<u8> &value_offsets, u4 block_sz, float occ_pct, std::shared_ptr<mmap_file_t> &mapping,
+                           bool drop_occ, u4 occ_threshold);
+
+/**
+ * Spill the buffered tuples to disk as a sorted run once they outgrow the build memory budget
+ */
+template <typename K, typename V>
+static inline void spill_if_needed(cq_runs_t<K, V> &runs, cqueue_t<K> &q_keys, cqueue_t<V> &q_values,
+                                   u8 build_mem, u4 block_sz) {
+    if (build_mem && q_keys.size() * (sizeof(K) + sizeof(V)) >= build_mem)
+        runs.spill(q_keys, q_values, block_sz);
+}
+
+// tuples queued between two checks of the build memory budget
+#define SPILL_CHECK_INTERVAL (1 << 20)
+
+/**
+ * Queue the tuples of a reference, checking the build memory budget every SPILL_CHECK_INTERVAL tuples, so that a
+ * chromosome-scale reference does not overshoot the budget
+ * @param value_at returns the value of the i-th key
+ */
+template <typename K, typename V, typename F>
+static void push_within_budget(cq_runs_t<K, V> &runs, cqueue_t<K> &q_keys, cqueue_t<V> &q_values, u8 build_mem,
+                               u4 block_sz, const K *keys, size_t n, F value_at) {
+    for (size_t i = 0; i < n; i += SPILL_CHECK_INTERVAL) {
+        const size_t m = std::min<size_t>(SPILL_CHECK_INTERVAL, n - i);
+        auto values = parlay::tabulate(m, [&](size_t j) { return (V)value_at(i + j); });
+        q_keys.push_back(keys + i, m);
+        q_values.push_back(values.data(), m);
+        spill_if_needed(runs, q_keys, q_values, build_mem, block_sz);
+    }
+}
 
 ////////////////////////////////////////////////////////////////////////////////
 
 void j_index_t::init_query_buffers() {
     log_info("In j_index_t");
     hhs = new heavyhitter_ht_t<u4>[parlay::num_workers()];
+    init_scratch();
     headers.emplace_back("*");
 }
 
 void j_index_t::add(std::string &name, parlay::slice<char *, char *> seq) {
     headers.push_back(name);
+    ref_lengths.push_back(seq.size());
     auto frag_offset = frag_offsets.back();
     auto kmers = create_kmers(seq, k, sigma, encode_dna);
     const u4 stride = frag_len - frag_ovlp_len;
@@ -44,18 +101,23 @@ void j_index_t::add(std::string &name, parlay::slice<char *, char *> seq) {
         q_keys.push_back(kmers.data() + i, count);
         auto values = parlay::sequence<u4>(count, frag_offset + j);
         q_values.push_back(values.data(), count);
+        spill_if_needed(runs, q_keys, q_values, build_mem, sort_blocksz);
     }
     frag_offsets.push_back(frag_offset + j);
 }
 
-std::tuple<const char *, u4, float> j_index_t::search(parlay::slice<char *, char *> seq) {
+std::tuple<const char *, u4, float> j_index_t::search(parlay::slice<const char*, const char*> seq) {
     const auto i = parlay::worker_id();
     auto &hh = hhs[i];
     hh.reset();
-    parlay::sequence<u4> keys = create_kmers_1t(seq, k, sigma, encode_dna);
+    auto &keys = scratch[i].keys;
+    create_kmers_1t(seq, k, sigma, encode_dna, keys);
     for (auto key : keys) {
-        const auto &[vbegin, vend] = get(key);
-        for (auto v = vbegin; v != vend; ++v) hh.insert(*v);
+        const auto [begin, end] = key_range(key);
+        if (end - begin > mask_occ) continue;
+        q_values.for_each_span(begin, end, [&](cqueue_t<u4>::span_t postings) {
+            for (auto v : postings) hh.insert(v);
+        });
     }
     if (hh.top_key != -1) {
         float presence = (hh.top_count * 1.0) / keys.size();
@@ -68,113 +130,294 @@ std::tuple<const char *, u4, float> j_index_t::search(parlay::slice<char *, char
 }
 
 void j_index_t::build() {
+    if (use_ef_offsets && !counting_sort) {
+        max_occ = consolidate_sparse(runs, q_keys, q_values);
+        return;
+    }
     value_offsets.resize(n_keys+1);
-    max_occ = consolidate(q_keys, q_values, value_offsets, sort_blocksz);
+    /// spilled runs drop overfull lists while they are merged, so that the merged values are never read back
+    const bool spilled = !runs.empty();
+    if (spilled) max_occ = consolidate_runs(runs, q_keys, q_values, value_offsets, sort_blocksz, occ_pct, mapping,
+                                            drop_occ, occ_threshold);
+    else if (counting_sort) max_occ = consolidate_by_counting(q_keys, q_values, value_offsets, sort_blocksz, occ_pct);
+    else max_occ = consolidate(q_keys, q_values, value_offsets, sort_blocksz, occ_pct);
+    if (drop_occ && !spilled) drop_overfull_lists(q_values, value_offsets, occ_threshold ? occ_threshold : max_occ);
+    offsets = value_offsets.data();
+    if (use_ef_offsets) compress_offsets();
 }
 
 void c_index_t::init_query_buffers() {
     log_info("In c_index_t");
     hhs = new heavyhitter_ht_t<u8>[parlay::num_workers()];
+    init_scratch();
 }
 
 void c_index_t::build() {
+    if (use_ef_offsets && !counting_sort) {
+        max_occ = consolidate_sparse(runs, q_keys, q_values);
+        pack_values();
+        return;
+    }
     value_offsets.resize(n_keys+1);
-    max_occ = consolidate(q_keys, q_values, value_offsets, sort_blocksz);
+    /// spilled runs drop overfull lists while they are merged, so that the merged values are never read back
+    const bool spilled = !runs.empty();
+    if (spilled) max_occ = consolidate_runs(runs, q_keys, q_values, value_offsets, sort_blocksz, occ_pct, mapping,
+                                            drop_occ, occ_threshold);
+    else if (counting_sort) max_occ = consolidate_by_counting(q_keys, q_values, value_offsets, sort_blocksz, occ_pct);
+    else max_occ = consolidate(q_keys, q_values, value_offsets, sort_blocksz, occ_pct);
+    if (drop_occ && !spilled) drop_overfull_lists(q_values, value_offsets, occ_threshold ? occ_threshold : max_occ);
+    offsets = value_offsets.data();
+    if (use_ef_offsets) compress_offsets();
+    pack_values();
+}
+
+void c_index_t::pack_values() {
+    u8 max_pos = 1;
+    for (auto length : ref_lengths) max_pos = std::max(max_pos, length << canonical);
+    const u4 n_refs = std::max<size_t>(headers.size(), 1);
+    pos_nbits = 64 - __builtin_clzll(std::max<u8>(max_pos - 1, 1));
+    const u4 id_nbits = 32 - __builtin_clz(std::max<u4>(n_refs - 1, 1));
+    p_values = packed_array_t(q_values.size(), id_nbits + pos_nbits, [&](size_t i) {
+        const u8 c = *q_values.data_at(i);
+        return (coord_id(c) << pos_nbits) | coord_pos(c);
+    });
+    log_info("Packed %zd coordinates into %u bits each (%u for the reference, %u for the position), %s instead of %s.",
+             p_values.size(), p_values.bits(), id_nbits, pos_nbits,
+             format_size(p_values.size_in_bytes()).c_str(), format_size(q_values.size() * sizeof(u8) * 1.0).c_str());
+    q_values.clear();
 }
 
 void c_index_t::add(std::string &name, parlay::slice<char *, char *> seq) {
+    auto kmers = create_kmers(seq, k, sigma, encode_dna);
+    parlay::sequence<u1> strands;
+    if (canonical) {
+        strands = parlay::sequence<u1>::uninitialized(kmers.size());
+        parlay::parallel_for(0, kmers.size(), [&](size_t i) {
+            const kmer_t rc = revcmp_kmer(kmers[i], k);
+            strands[i] = rc < kmers[i];
+            kmers[i] = std::min(kmers[i], rc);
+        });
+    }
+    add_kmers(name, seq.size(), kmers, strands);
+}
+
+void c_index_t::add_kmers(std::string &name, size_t length, const parlay::sequence<kmer_t> &kmers,
+                          const parlay::sequence<u1> &strands) {
     const u4 id = headers.size();
+    if (id >= coord_max_refs) log_error("The index can not hold more than %llu references.", coord_max_refs);
+    if ((length << canonical) > (1ULL << coord_pos_nbits))
+        log_error("Reference %s is too long to be indexed.", name.c_str());
     headers.push_back(name);
+    ref_lengths.push_back(length);
+    /// the coordinate of a canonical k-mer carries its strand in the lowest bit
+    auto coordinate = [&](u8 pos) {
+        return strands.empty() ? make_coord(id, pos) : make_coord(id, (pos << 1) | strands[pos]);
+    };
 
-    auto kmers = create_kmers(seq, k, sigma, encode_dna);
-    q_keys.push_back(kmers.data(), kmers.size());
+    if (sampling != config_t::no_sampling) {
+        auto positions = sample(kmers);
+        auto keys = parlay::tabulate(positions.size(), [&](size_t i) {
+            return kmers[positions[i]];
+        });
+        push_within_budget(runs, q_keys, q_values, build_mem, sort_blocksz, keys.data(), keys.size(), [&](size_t i) {
+            return coordinate(positions[i]);
+        });
+        return;
+    }
+    push_within_budget(runs, q_keys, q_values, build_mem, sort_blocksz, kmers.data(), kmers.size(), coordinate);
+}
 
-    auto addresses = parlay::tabulate(kmers.size(), [&](size_t i) {
-        return make_key_from(id, i);
-    });
+/**
+ * Replace the k-mers of a query in the scratch buffers by their canonical k-mers, noting which of them are reverse
+ * complements
+ */
+template <typename T>
+static void create_canonical_kmers_1t(const T &seq, int k, search_scratch_t &s) {
+    create_kmers_both_1t(seq, k, s.keys, s.rc_keys);
+    const size_t n = s.keys.size();
+    s.strands.resize(n);
+    for (size_t j = 0; j < n; ++j) {
+        const kmer_t rc = s.rc_keys[n - 1 - j];
+        s.strands[j] = rc < s.keys[j];
+        s.keys[j] = std::min(s.keys[j], rc);
+    }
+}
 
-    q_values.push_back(addresses.data(), addresses.size());
+std::tuple<const char *, u4, float> c_index_t::search(parlay::slice<const char*, const char*> seq) {
+    auto &s = scratch[parlay::worker_id()];
+    if (canonical) create_canonical_kmers_1t(seq, k, s);
+    else create_kmers_1t(seq, k, sigma, encode_dna, s.keys);
+    const auto [header, fwd, pos, presence] = search_kmers(s, false);
+    return std::make_tuple(header, pos, presence);
+}
+
+std::tuple<const char *, bool, u4, float> c_index_t::search_both(parlay::slice<const char*, const char*> seq) {
+    auto &s = scratch[parlay::worker_id()];
+    /// canonical k-mers already match both strands
+    if (canonical) {
+        create_canonical_kmers_1t(seq, k, s);
+        return search_kmers(s, false);
+    }
+    create_kmers_both_1t(seq, k, s.keys, s.rc_keys);
+    return search_kmers(s, true);
 }
 
-std::tuple<const char *, u4, float> c_index_t::search(parlay::slice<char *, char *> seq) {
+template <typename P>
+std::tuple<const char *, bool, u4, float> c_index_t::vote_kmers(search_scratch_t &s, bool both_strands, const P &postings) {
     const auto i = parlay::worker_id();
     auto &hh = hhs[i];
     hh.reset();
-    parlay::sequence<u4> keys = create_kmers_1t(seq, k, sigma, encode_dna);
-    for (u4 j = 0; j < keys.size(); ++j) {
-        const auto &[vbegin, vend] = get(keys[j]);
-        for (auto v = vbegin; v != vend; ++v) {
-            u8 ref_id = get_id_from(*v);
-            u8 ref_pos = get_pos_from(*v);
-            u8 intercept = (ref_pos > j) ? (ref_pos - j) : 0;
-            intercept /= bandwidth;
-            u8 key = make_key_from(ref_id, intercept);
+    const bool sampled = sampling != config_t::no_sampling;
+    size_t n_seeds[2] = {0, 0};
+
+    const size_t n_kmers = s.keys.size();
+
+    /// votes of both strands go to the same counter, tagged with the strand in the lowest bit of the diagonal
+    const u4 diag_shift = pos_nbits + 1;
+    const u8 pos_mask = (1ULL << pos_nbits) - 1;
+    auto vote = [&](const u8 v, u4 j, u8 rev) {
+        u8 ref_id = v >> pos_nbits;
+        u8 ref_pos = v & pos_mask;
+        if (canonical) {
+            /// a canonical k-mer matches the reverse complement of the query if it was reverse complemented for one of
+            /// them but not for the other, and then it is at the mirrored position in the reverse complement
+            rev = (ref_pos & 1) ^ s.strands[j];
+            ref_pos >>= 1;
+            if (rev) j = n_kmers - 1 - j;
+        }
+        u8 intercept = (ref_pos > j) ? (ref_pos - j) : 0;
+        intercept /= bandwidth;
+        u8 key = (ref_id << diag_shift) | (intercept << 1) | rev;
+        hh.insert(key);
+        if (intercept >= bandwidth) {
+            intercept -= bandwidth;
+            key = (ref_id << diag_shift) | (intercept << 1) | rev;
             hh.insert(key);
-            if (intercept >= bandwidth) {
-                intercept -= bandwidth;
-                key = make_key_from(ref_id, intercept);
-                hh.insert(key);
+        }
+    };
+
+    for (u8 rev = 0; rev < (both_strands ? 2 : 1); ++rev) {
+        const auto &keys = rev ? s.rc_keys : s.keys;
+        auto &positions = rev ? s.rc_positions : s.positions;
+        if (sampled) sample(keys, positions, s.hashes);
+        const size_t n = n_seeds[rev] = sampled ? positions.size() : keys.size();
+        if (canonical) n_seeds[1] = n;
+        /// j is the position of the k-mer in the query, so that sampled k-mers vote on the true diagonal
+        auto seed_pos = [&](size_t t) -> u4 { return sampled ? positions[t] : t; };
+
+        /// resolve all posting lists first; offsets are looked up in random order, so prefetch them a few seeds ahead
+        auto &ranges = s.ranges;
+        ranges.resize(n);
+        for (size_t t = 0; t < n; ++t) {
+            if (offsets && t + SEARCH_PREFETCH_DIST < n) __builtin_prefetch(offsets + keys[seed_pos(t + SEARCH_PREFETCH_DIST)]);
+            ranges[t] = key_range(keys[seed_pos(t)]);
+            if (ranges[t].second - ranges[t].first > mask_occ) ranges[t].second = ranges[t].first;
+        }
+
+        /// then stream the postings block by block, prefetching the head of the lists a few seeds ahead
+        for (size_t t = 0; t < n; ++t) {
+            if (t + SEARCH_PREFETCH_DIST < n) {
+                const auto &[b, e] = ranges[t + SEARCH_PREFETCH_DIST];
+                if (b < e) postings.prefetch(b);
             }
+            const u4 j = seed_pos(t);
+            postings.for_each(ranges[t].first, ranges[t].second, [&](const u8 v) { vote(v, j, rev); });
         }
     }
     if (hh.top_key != -1) {
-        float presence = (hh.top_count * 1.0) / keys.size();
-        if (presence < presence_fraction) return {"*", 0, 0.0f};
-        auto id = get_id_from(hh.top_key);
-        auto &header = headers[get_id_from(hh.top_key)];
-        return std::make_tuple(header.c_str(), get_pos_from(hh.top_key) * bandwidth, presence);
-    } else return {"*", 0, 0.0f};
+        const u8 diagonal = hh.top_key & ((1ULL << diag_shift) - 1);
+        const bool rev = diagonal & 1;
+        float presence = (hh.top_count * 1.0) / n_seeds[rev];
+        if (presence < presence_fraction) return {"*", true, 0, 0.0f};
+        auto &header = headers[hh.top_key >> diag_shift];
+        return std::make_tuple(header.c_str(), !rev, (diagonal >> 1) * bandwidth, presence);
+    } else return {"*", true, 0, 0.0f};
 }
 
-void j_index_t::dump(std::ostream &fs) {
-    dump_headers(fs, headers);
-    dump_coordinates(fs, value_offsets, q_values);
-    dump_values(fs, max_occ);
-    dump_seq(fs, frag_offsets);
+/**
+ * Postings of a coordinate index, read straight from the packed array
+ */
+struct packed_postings_t {
+    const packed_array_t &values;
+    inline void prefetch(const u8 b) const { __builtin_prefetch(values.data_at(b)); }
+    template <typename F>
+    inline void for_each(const u8 b, const u8 e, F f) const { values.for_each(b, e, f); }
+};
+
+std::tuple<const char *, bool, u4, float> c_index_t::search_kmers(search_scratch_t &s, bool both_strands) {
+    return vote_kmers(s, both_strands, packed_postings_t{p_values});
 }
 
-void j_index_t::load(std::istream &fs) {
-    load_headers(fs, headers);
-    load_coordinates(fs, value_offsets, q_values);
-    load_values(fs, &max_occ);
-    load_seq(fs, frag_offsets);
+void s_index_t::add(std::string &name, parlay::slice<char *, char *> seq) {
+    log_error("A signal index is built from expected signals, not from sequences.");
 }
 
-void c_index_t::dump(std::ostream &fs) {
-    dump_headers(fs, headers);
-    dump_coordinates(fs, value_offsets, q_values);
-    dump_values(fs, max_occ);
+void s_index_t::add_signal(std::string &name, parlay::slice<u1 *, u1 *> qsig) {
+    auto kmers = create_kmers(qsig, k, sigma, encode_qsig);
+    add_kmers(name, qsig.size(), kmers);
 }
 
-void c_index_t::load(std::istream &fs) {
-    load_headers(fs, headers);
-    load_coordinates(fs, value_offsets, q_values);
-    load_values(fs, &max_occ);
+std::tuple<const char *, u4, float> s_index_t::search(parlay::slice<const char*, const char*> seq) {
+    log_error("A signal index is queried with raw signals, not with sequences.");
+    return {"*", 0, 0.0f};
 }
 
-template <typename K, typename V>
-static void simple_sort_by_key(parlay::sequence<K> &keys, parlay::sequence<V> &values) {
-    // Step 1: Create a vector of indices
-    parlay::sequence<u4> indices(keys.size());
-    for (int i = 0; i < keys.size(); ++i) {
-        indices[i] = i; // Fill with the original indices
-    }
+std::tuple<const char *, bool, u4, float> s_index_t::search_both(parlay::slice<const char*, const char*> seq) {
+    log_error("A signal index is queried with raw signals, not with sequences.");
+    return {"*", true, 0, 0.0f};
+}
 
-    // Step 2: Sort the indices based on values in keys
-    std::sort(indices.begin(), indices.end(), [&keys](int i1, int i2) {
-        return keys[i1] < keys[i2];  // Compare based on the values of keys
-    });
+std::tuple<const char *, u4, float> s_index_t::search_signal(parlay::slice<u1 *, u1 *> qsig) {
+    if (qsig.size() <= 2 * k) return {"*", 0, 0.0f};
+    auto &s = scratch[parlay::worker_id()];
+    create_kmers_1t(qsig, k, sigma, encode_qsig, s.keys);
+    const auto [header, fwd, pos, presence] = search_kmers(s, false);
+    return std::make_tuple(header, pos, presence);
+}
 
-    // Step 3: Reorder keys and values according to the sorted indices
-    parlay::sequence<K> keys_sorted(keys.size());
-    parlay::sequence<V> values_sorted(keys.size());
-    for (u4 i = 0; i < indices.size(); ++i) {
-        keys_sorted[i] = keys[indices[i]];
-        values_sorted[i] = values[indices[i]];
-    }
+void j_index_t::dump(cidx_writer_t &fs) {
+    dump_headers(fs, headers, ref_lengths);
+    dump_coordinates(fs, value_offsets, ef_offsets, q_values);
+    dump_values(fs.begin(SEC_STATS), max_occ);
+    fs.end();
+    dump_seq(fs.begin(SEC_FRAGMENTS), frag_offsets);
+    fs.end();
+}
+
+void j_index_t::load(cidx_reader_t &fs) {
+    mapping = fs.mapping();
+    load_headers(fs, headers, ref_lengths);
+    map_coordinates(fs, offsets, ef_offsets, q_values);
+    auto stats = fs.section(SEC_STATS);
+    load_values(stats, &max_occ);
+    auto fragments = fs.section(SEC_FRAGMENTS);
+    load_seq(fragments, frag_offsets);
+}
 
-    keys = std::move(keys_sorted);
-    values = std::move(values_sorted);
+void c_index_t::dump(cidx_writer_t &fs) {
+    dump_headers(fs, headers, ref_lengths);
+    dump_offsets(fs, value_offsets, ef_offsets);
+    log_info("Dumping packed values..");
+    auto &section = fs.begin(SEC_PACKED_VALUES);
+    dump_values(section, pos_nbits);
+    p_values.dump(section);
+    fs.end();
+    dump_values(fs.begin(SEC_STATS), max_occ);
+    fs.end();
+    log_info("Done.");
+}
+
+void c_index_t::load(cidx_reader_t &fs) {
+    mapping = fs.mapping();
+    load_headers(fs, headers, ref_lengths);
+    map_offsets(fs, offsets, ef_offsets);
+    log_info("Mapping packed values..");
+    auto section = fs.section(SEC_PACKED_VALUES);
+    load_values(section, &pos_nbits);
+    p_values.load(section);
+    auto stats = fs.section(SEC_STATS);
+    load_values(stats, &max_occ);
+    log_info("Done.");
 }
 
 template <typename T>
@@ -193,36 +436,151 @@ static parlay::sequence<u4> find_run_offsets(parlay::sequence<T> &values) {
     return offsets;
 }
 
-static parlay::sequence<u4> get_minimizer_indices(parlay::sequence<u4> &keys, int w) {
+/**
+ * Order in which k-mers and s-mers compete for being sampled.
+ * Lexicographic order would favour poly-A runs, so codes are compared by a hash instead.
+ */
+static inline u8 sampling_order(kmer_t code) {
+    return XXH64_hash64(code, 0);
+}
+
+/**
+ * Positions of the (w,k)-minimizers of a sequence: the leftmost k-mer with the smallest hash in every window of w
+ * consecutive k-mers. A sequence shorter than one window yields its single minimum.
+ * @param keys all k-mers of the sequence
+ * @param w window length in k-mers
+ * @return sampled positions in ascending order
+ */
+static parlay::sequence<u4> get_minimizer_indices(const parlay::sequence<kmer_t> &keys, int w) {
     size_t n = keys.size();
-    if (w > n) return {};
+    if (n == 0) return {};
+    if (w > n) w = n;
+    auto hashes = parlay::map(keys, sampling_order);
     auto midx = parlay::tabulate(n - w + 1, [&](size_t i){
-        u4 min_key = -1, min_idx = -1;
+        u8 min_hash = -1; u4 min_idx = i;
         for (u4 j = i; j < i+w; ++j) {
-            if (keys[j] < min_key) min_key = keys[j], min_idx = j;
+            if (hashes[j] < min_hash) min_hash = hashes[j], min_idx = j;
         }
         return min_idx;
     });
     return parlay::unique(midx);
 }
 
+/**
+ * A k-mer is an open syncmer if the smallest of its k-s+1 s-mers is the first one, and a closed syncmer if it is the
+ * first or the last one. Ties are broken towards the leftmost s-mer.
+ * @param k k-mer length
+ * @param s s-mer length
+ * @param closed test for a closed instead of an open syncmer
+ */
+static inline bool is_syncmer(kmer_t key, int k, int s, bool closed) {
+    const kmer_t smask = ((kmer_t)1 << (2 * s)) - 1;
+    const int n_smers = k - s + 1;
+    u8 min_hash = -1; int min_o = 0;
+    for (int o = 0; o < n_smers; ++o) {
+        u8 h = sampling_order((key >> (2 * (k - s - o))) & smask);
+        if (h < min_hash) min_hash = h, min_o = o;
+    }
+    return min_o == 0 || (closed && min_o == n_smers - 1);
+}
+
+/**
+ * Positions of the syncmers of a sequence
+ * @param keys all k-mers of the sequence
+ * @return sampled positions in ascending order
+ */
+static parlay::sequence<u4> get_syncmer_indices(const parlay::sequence<kmer_t> &keys, int k, int s, bool closed) {
+    auto flags = parlay::tabulate(keys.size(), [&](size_t i) -> u1 {
+        return is_syncmer(keys[i], k, s, closed);
+    });
+    return parlay::pack_index<u4>(flags);
+}
+
+void c_index_t::sample(const std::vector<kmer_t> &keys, std::vector<u4> &positions, std::vector<u8> &hashes) const {
+    const size_t n = keys.size();
+    positions.clear();
+    switch (sampling) {
+        case config_t::minimizer: {
+            if (n == 0) return;
+            const size_t w = std::min((size_t)sampling_w, n);
+            hashes.resize(n);
+            for (size_t i = 0; i < n; ++i) hashes[i] = sampling_order(keys[i]);
+            for (size_t i = 0; i + w <= n; ++i) {
+                u8 min_hash = -1; u4 min_idx = i;
+                for (u4 j = i; j < i+w; ++j) {
+                    if (hashes[j] < min_hash) min_hash = hashes[j], min_idx = j;
+                }
+                if (positions.empty() || positions.back() != min_idx) positions.push_back(min_idx);
+            }
+            return;
+        }
+        case config_t::open_syncmer:
+        case config_t::closed_syncmer: {
+            const bool closed = sampling == config_t::closed_syncmer;
+            for (size_t i = 0; i < n; ++i)
+                if (is_syncmer(keys[i], k, syncmer_s, closed)) positions.push_back(i);
+            return;
+        }
+        default:
+            positions.resize(n);
+            for (size_t i = 0; i < n; ++i) positions[i] = i;
+    }
+}
+
+parlay::sequence<u4> c_index_t::sample(const parlay::sequence<kmer_t> &kmers) const {
+    switch (sampling) {
+        case config_t::minimizer: return get_minimizer_indices(kmers, sampling_w);
+        case config_t::open_syncmer: return get_syncmer_indices(kmers, k, syncmer_s, false);
+        case config_t::closed_syncmer: return get_syncmer_indices(kmers, k, syncmer_s, true);
+        default: return parlay::tabulate(kmers.size(), [](size_t i) { return (u4)i; });
+    }
+}
+
 template <typename T>
-static T calc_max_occ(parlay::sequence<T> &counts) {
+static T calc_max_occ(parlay::sequence<T> &counts, float pct = 99) {
     auto f_counts = parlay::filter(counts, [](T x) { return x != 0; });
+    if (f_counts.empty()) return 0;
     parlay::integer_sort_inplace(f_counts);
-    auto occ = f_counts[f_counts.size() * 99/100];
+    auto occ = f_counts[MIN((size_t)(f_counts.size() * pct / 100), f_counts.size() - 1)];
     log_info("Min occ. = %lu", f_counts.front());
     log_info("Median occ. = %lu", f_counts[f_counts.size()/2]);
     log_info("Max occ. = %lu", f_counts.back());
-    log_info("99%% = %lu", occ);
+    log_info("%g%% = %lu", pct, occ);
     return occ;
 }
 
+/**
+ * Remove the posting lists that are longer than a threshold, leaving their keys with empty lists
+ * @param values posting lists, replaced by the retained ones
+ * @param value_offsets offsets of the posting lists, updated in place
+ * @param limit occurrence threshold
+ */
+template <typename V>
+static void drop_overfull_lists(cqueue_t<V> &values, parlay::sequence<u8> &value_offsets, u8 limit) {
+    const size_t n_keys = value_offsets.size() - 1;
+    cqueue_t<V> retained;
+    size_t n_dropped = 0, n_dropped_values = 0;
+    u8 start = value_offsets[0];
+    for (size_t key = 0; key < n_keys; ++key) {
+        const u8 end = value_offsets[key+1];
+        value_offsets[key] = retained.size();
+        if (end - start > limit) n_dropped++, n_dropped_values += end - start;
+        else values.for_each_span(start, end, [&](typename cqueue_t<V>::span_t postings) {
+            retained.push_back((V*)postings.data, postings.size);
+        });
+        start = end;
+    }
+    value_offsets[n_keys] = retained.size();
+    values = std::move(retained);
+    MEMPOOL_SHRINK(V);
+    log_info("Dropped %zd k-mers with more than %lu occurrences (%zd postings).", n_dropped, limit, n_dropped_values);
+}
+
 template <typename K, typename V>
-static u4 consolidate(cqueue_t<K> &q_keys, cqueue_t<V> &q_values, parlay::sequence<u8> &value_offsets, u4 block_sz) {
+static u4 consolidate(cqueue_t<K> &q_keys, cqueue_t<V> &q_values, parlay::sequence<u8> &value_offsets, u4 block_sz, float occ_pct) {
     expect(q_keys.size() == q_values.size());
     log_info("Sorting %zd tuples..", q_keys.size());
-    size_t bufsz = (sizeof(K) + sizeof(V)) * block_sz;
+    size_t bufsz = 2 * (sizeof(K) + sizeof(V)) * block_sz;
     auto buf = malloc(bufsz);
     cq_sort_by_key(q_keys, q_values, block_sz, buf);
 
@@ -247,7 +605,7 @@ static u4 consolidate(cqueue_t<K> &q_keys, cqueue_t<V> &q_values, parlay::sequen
     MEMPOOL_SHRINK(V);
     PRINT_MEM_USAGE(K);
     PRINT_MEM_USAGE(V);
-    auto occ99 = calc_max_occ(value_offsets);
+    auto occ99 = calc_max_occ(value_offsets, occ_pct);
 
     parlay::scan_inplace(value_offsets);
     verify(parlay::is_sorted(value_offsets));
@@ -256,46 +614,299 @@ static u4 consolidate(cqueue_t<K> &q_keys, cqueue_t<V> &q_values, parlay::sequen
     return occ99;
 }
 
-static void dump_headers(std::ostream &fs, std::vector<std::string> &headers) {
+/**
+ * Build posting lists without sorting by exploiting that keys are dense in [0, n_keys).
+ * The first pass counts keys into `value_offsets`, which is then prefix-summed; the second pass scatters every value
+ * straight into its slot. Values are added in ascending order, so sorting each (mostly tiny) posting list afterwards
+ * restores exactly the order a stable sort by key would have produced.
+ * @return the 99th percentile of posting list lengths
+ */
+template <typename K, typename V>
+static u4 consolidate_by_counting(cqueue_t<K> &q_keys, cqueue_t<V> &q_values, parlay::sequence<u8> &value_offsets, u4 block_sz, float occ_pct) {
+    expect(q_keys.size() == q_values.size());
+    const size_t N = q_keys.size(), n_keys = value_offsets.size() - 1;
+    u8 *counts = value_offsets.data();
+    log_info("Counting %zd keys..", N);
+    p_fill(counts, n_keys + 1, 0UL);
+    q_keys.for_each_block([&](const K *keys, size_t n) {
+        parlay::parallel_for(0, n, [&](size_t i) {
+            __atomic_fetch_add(counts + keys[i], 1, __ATOMIC_RELAXED);
+        });
+    });
+    auto occ99 = calc_max_occ(value_offsets, occ_pct);
+    parlay::scan_inplace(value_offsets);
+
+    log_info("Scattering %zd values..", N);
+    cqueue_t<V> values;
+    values.extend(N);
+    auto buf = malloc((sizeof(K) + sizeof(V)) * block_sz);
+    auto d_keys = (K*)buf;
+    auto d_values = (V*)(d_keys + block_sz);
+    while (true) {
+        size_t nk = q_keys.pop_front(d_keys, block_sz);
+        size_t nv = q_values.pop_front(d_values, block_sz);
+        expect(nk == nv);
+        if (!nk) break;
+        parlay::parallel_for(0, nk, [&](size_t i) {
+            u8 slot = __atomic_fetch_add(counts + d_keys[i], 1, __ATOMIC_RELAXED);
+            values.at(slot) = d_values[i];
+        });
+    }
+    free(buf);
+    MEMPOOL_SHRINK(K);
+    MEMPOOL_SHRINK(V);
+
+    /// every counter now points at the end of its list, i.e. the start of the next one
+    memmove(counts + 1, counts, n_keys * sizeof(u8));
+    counts[0] = 0;
+    verify(counts[n_keys] == N);
+
+    log_info("Ordering posting lists..");
+    parlay::parallel_for(0, n_keys, [&](size_t key) {
+        const u8 start = counts[key], end = counts[key+1];
+        if (end - start < 2) return;
+        if (MPDIV(start) == MPDIV(end - 1)) {
+            V *p = &values.at(start);
+            std::sort(p, p + (end - start));
+        } else {
+            std::vector<V> tmp(end - start);
+            for (u8 i = start; i < end; ++i) tmp[i - start] = values.at(i);
+            std::sort(tmp.begin(), tmp.end());
+            for (u8 i = start; i < end; ++i) values.at(i) = tmp[i - start];
+        }
+    });
+
+    q_values = std::move(values);
+    PRINT_MEM_USAGE(K);
+    PRINT_MEM_USAGE(V);
+    return occ99;
+}
+
+/**
+ * Build posting lists from sorted runs spilled to disk.
+ * The tuples still in memory become the last run, then all runs are merged in one pass: keys are only counted, and
+ * values are streamed into a file in the temporary directory which is memory-mapped as the values of the index.
+ * @return the 99th percentile of posting list lengths
+ */
+template <typename K, typename V>
+static u4 consolidate_runs(cq_runs_t<K, V> &runs, cqueue_t<K> &q_keys, cqueue_t<V> &q_values,
+                           parlay::sequence<u8> &value_offsets, u4 block_sz, float occ_pct, std::shared_ptr<mmap_file_t> &mapping,
+                           bool drop_occ, u4 occ_threshold) {
+    runs.spill(q_keys, q_values, block_sz);
+    const size_t N = runs.size(), n_keys = value_offsets.size() - 1;
+    log_info("Counting %zd keys on disk..", N);
+    u8 *counts = value_offsets.data();
+    p_fill(counts, value_offsets.size(), 0UL);
+    runs.for_each_key_block([&](const K *keys, size_t n) {
+        parlay::parallel_for(0, n, [&](size_t i) {
+            __atomic_fetch_add(counts + keys[i], 1, __ATOMIC_RELAXED);
+        });
+    });
+    auto occ99 = calc_max_occ(value_offsets, occ_pct);
+
+    /// the lengths of all lists are known before merging, so overfull ones are left out of the merged values
+    const u8 limit = drop_occ ? (occ_threshold ? occ_threshold : occ99) : ~0ULL;
+    const size_t n_kept = parlay::reduce(parlay::delayed_tabulate(n_keys, [&](size_t key) {
+        return counts[key] <= limit ? counts[key] : (u8)0;
+    }));
+    if (drop_occ) {
+        const size_t n_dropped = parlay::reduce(parlay::delayed_tabulate(n_keys, [&](size_t key) {
+            return (size_t)(counts[key] > limit);
+        }));
+        log_info("Dropping %zd k-mers with more than %lu occurrences (%zd postings).", n_dropped, limit, N - n_kept);
+    }
+
+    log_info("Merging %zd tuples from disk..", n_kept);
+    auto values_filename = runs.merge_values(block_sz, n_kept, [&](const K key) { return counts[key] <= limit; });
+    if (drop_occ) parlay::parallel_for(0, n_keys, [&](size_t key) { if (counts[key] > limit) counts[key] = 0; });
+    mapping = std::make_shared<mmap_file_t>(values_filename);
+    unlink(values_filename.c_str());
+    mmap_reader_t f(mapping);
+    q_values.load(f);
+    verify(q_values.size() == n_kept);
+
+    parlay::scan_inplace(value_offsets);
+    PRINT_MEM_USAGE(K);
+    PRINT_MEM_USAGE(V);
+    return occ99;
+}
+
+/**
+ * Remove the posting lists that are longer than a threshold
+ * @param values posting lists sorted by key, replaced by the retained ones
+ * @param lengths lengths of the posting lists in the order of their keys
+ * @param limit occurrence threshold
+ */
+template <typename V>
+static void drop_overfull_lists(cqueue_t<V> &values, const parlay::sequence<u4> &lengths, u8 limit) {
+    cqueue_t<V> retained;
+    size_t n_dropped = 0, n_dropped_values = 0;
+    u8 start = 0;
+    for (auto length : lengths) {
+        if (length > limit) n_dropped++, n_dropped_values += length;
+        else values.for_each_span(start, start + length, [&](typename cqueue_t<V>::span_t postings) {
+            retained.push_back((V*)postings.data, postings.size);
+        });
+        start += length;
+    }
+    values = std::move(retained);
+    MEMPOOL_SHRINK(V);
+    log_info("Dropped %zd k-mers with more than %lu occurrences (%zd postings).", n_dropped, limit, n_dropped_values);
+}
+
+template <typename K, typename V>
+u4 index_t::consolidate_sparse(cq_runs_t<K, V> &runs, cqueue_t<K> &q_keys, cqueue_t<V> &q_values) {
+    cqueue_t<K> keys;           /// the distinct keys in ascending order
+    parlay::sequence<u4> lengths;
+    {
+        cqueue_t<u4> counts;
+        const bool spilled = !runs.empty();
+        if (spilled) {
+            runs.spill(q_keys, q_values, sort_blocksz);
+            log_info("Counting %zd keys on disk..", runs.size());
+            runs.count_keys(sort_blocksz, keys, counts);
+        } else {
+            expect(q_keys.size() == q_values.size());
+            log_info("Sorting %zd tuples..", q_keys.size());
+            auto buf = malloc(2 * (sizeof(K) + sizeof(V)) * sort_blocksz);
+            cq_sort_by_key(q_keys, q_values, sort_blocksz, buf);
+            log_info("Counting unique keys..");
+            cq_count_unique(q_keys, sort_blocksz, buf, keys, counts);
+            free(buf);
+            MEMPOOL_SHRINK(K);
+        }
+        lengths = parlay::sequence<u4>::uninitialized(counts.size());
+        size_t i = 0;
+        counts.for_each_block([&](const u4 *c, size_t n) { std::copy(c, c + n, lengths.begin() + i); i += n; });
+    }
+    const size_t n_lists = lengths.size();
+    const u4 occ = calc_max_occ(lengths, occ_pct);
+
+    const u8 limit = drop_occ ? (occ_threshold ? occ_threshold : occ) : ~0ULL;
+    const u8 n_kept = parlay::reduce(parlay::delayed_tabulate(n_lists, [&](size_t r) {
+        return lengths[r] <= limit ? (u8)lengths[r] : (u8)0;
+    }));
+    const u8 n_kept_lists = parlay::reduce(parlay::delayed_tabulate(n_lists, [&](size_t r) {
+        return (u8)(lengths[r] <= limit);
+    }));
+    if (!runs.empty()) {
+        if (drop_occ) log_info("Dropping %zd k-mers with more than %lu occurrences (%zd postings).",
+                               n_lists - n_kept_lists, limit, runs.size() - n_kept);
+        log_info("Merging %zd tuples from disk..", n_kept);
+        /// keys are merged in ascending order, and a key is asked for again when its tuples span two merged chunks
+        size_t r = 0;
+        auto values_filename = runs.merge_values(sort_blocksz, n_kept, [&](const K key) {
+            while (keys[r] < key) ++r;
+            return lengths[r] <= limit;
+        });
+        mapping = std::make_shared<mmap_file_t>(values_filename);
+        unlink(values_filename.c_str());
+        mmap_reader_t f(mapping);
+        q_values.load(f);
+    } else if (drop_occ) drop_overfull_lists(q_values, lengths, limit);
+    verify(q_values.size() == n_kept);
+
+    ef_offsets.encode(n_keys, n_kept_lists, n_kept, [&](auto emit) {
+        size_t r = 0;
+        keys.for_each_block([&](const K *block, size_t n) {
+            for (size_t j = 0; j < n; ++j, ++r) if (lengths[r] <= limit) emit(block[j], lengths[r]);
+        });
+    });
+    offsets = nullptr;
+    log_info("Encoded the offsets of %zd posting lists in %s.", n_kept_lists, format_size(ef_offsets.size_in_bytes()).c_str());
+    PRINT_MEM_USAGE(K);
+    PRINT_MEM_USAGE(V);
+    return occ;
+}
+
+void index_t::compress_offsets() {
+    const u8 n_values = value_offsets.back();
+    const u8 n_lists = parlay::reduce(parlay::delayed_tabulate(n_keys, [&](size_t key) {
+        return (u8)(value_offsets[key] < value_offsets[key+1]);
+    }));
+    ef_offsets.encode(n_keys, n_lists, n_values, [&](auto emit) {
+        for (u8 key = 0; key < n_keys; ++key)
+            if (value_offsets[key] < value_offsets[key+1]) emit(key, value_offsets[key+1] - value_offsets[key]);
+    });
+    log_info("Compressed value offsets from %s to %s",
+             format_size(value_offsets.size() * 8.0).c_str(), format_size(ef_offsets.size_in_bytes()).c_str());
+    parlay::sequence<u8> tmp;
+    value_offsets.swap(tmp);
+    offsets = nullptr;
+}
+
+static void dump_headers(cidx_writer_t &fs, std::vector<std::string> &headers, std::vector<u8> &lengths) {
     size_t n = headers.size();
     log_info("Dumping %zd headers..", n);
-    dump_values(fs, n);
-    for (const auto& refname : headers) dump_seq(fs, refname);
+    auto &section = fs.begin(SEC_HEADERS);
+    dump_values(section, n);
+    for (const auto& refname : headers) dump_seq(section, refname);
+    fs.end();
+    dump_seq(fs.begin(SEC_REF_LENGTHS), lengths);
+    fs.end();
     log_info("Done.");
 }
 
-static void load_headers(std::istream &fs, std::vector<std::string> &headers) {
+static void load_headers(cidx_reader_t &fs, std::vector<std::string> &headers, std::vector<u8> &lengths) {
+    auto section = fs.section(SEC_HEADERS);
     size_t n;
-    load_values(fs, &n);
+    load_values(section, &n);
     log_info("Loading %zd headers..", n);
     for (int i = 0; i < n; ++i) {
         std::string tmp;
-        load_seq(fs, tmp);
+        load_seq(section, tmp);
         headers.emplace_back(tmp);
     }
+    if (fs.has(SEC_REF_LENGTHS)) {
+        auto lengths_section = fs.section(SEC_REF_LENGTHS);
+        load_seq(lengths_section, lengths);
+    }
     log_info("Done.");
 }
 
-template <typename V>
-static void dump_coordinates(std::ostream &fs, parlay::sequence<u8> &offsets, cqueue_t<V> &values) {
+static void dump_offsets(cidx_writer_t &fs, parlay::sequence<u8> &offsets, ef_offsets_t &ef_offsets) {
     log_info("Dumping counts..");
-    dump_seq(fs, offsets);
+    if (!offsets.empty()) dump_aligned_seq(fs.begin(SEC_OFFSETS), offsets);
+    else ef_offsets.serialize(fs.begin(SEC_EF_OFFSETS));
+    fs.end();
+}
+
+static void map_offsets(cidx_reader_t &fs, const u8 *&offsets, ef_offsets_t &ef_offsets) {
+    if (fs.has(SEC_EF_OFFSETS)) {
+        log_info("Loading compressed counts..");
+        auto ef_fs = fs.istream(SEC_EF_OFFSETS);
+        ef_offsets.load(ef_fs);
+        offsets = nullptr;
+    } else {
+        log_info("Mapping counts..");
+        auto section = fs.section(SEC_OFFSETS);
+        offsets = map_aligned_seq<u8>(section).first;
+    }
+}
+
+template <typename V>
+static void dump_coordinates(cidx_writer_t &fs, parlay::sequence<u8> &offsets, ef_offsets_t &ef_offsets, cqueue_t<V> &values) {
+    dump_offsets(fs, offsets, ef_offsets);
     log_info("Dumping values..");
-    values.dump(dynamic_cast<ofstream &>(fs));
+    values.dump(fs.begin(SEC_VALUES));
+    fs.end();
     log_info("Done.");
 }
 
 template <typename V>
-static void load_coordinates(std::istream &fs, parlay::sequence<u8> &offsets, cqueue_t<V> &values) {
-    log_info("Loading counts..");
-    load_seq(fs, offsets);
-    log_info("Loading values..");
-    values.load(dynamic_cast<ifstream &>(fs));
+static void map_coordinates(cidx_reader_t &fs, const u8 *&offsets, ef_offsets_t &ef_offsets, cqueue_t<V> &values) {
+    map_offsets(fs, offsets, ef_offsets);
+    log_info("Mapping values..");
+    auto section = fs.section(SEC_VALUES);
+    values.load(section);
     log_info("Done.");
 }
 
 void dindex_t::add(string &name, parlay::slice<char *, char *> seq) {
+    std::lock_guard<std::mutex> parlay_lock(external_parlay_mutex());
     auto kmers = create_kmers(seq, k, sigma, encode_dna);
+
+    std::lock_guard<std::mutex> lock(pending_mtx);
     keys.append(kmers.begin(), kmers.end());
 
     const auto& [id, offset] = headers.get_id_offset(name);
@@ -308,107 +919,149 @@ void dindex_t::add(string &name, parlay::slice<char *, char *> seq) {
 }
 
 void dindex_t::merge() {
-    const u4 n = keys.size();
+    std::lock_guard<std::mutex> merge_lock(merge_mtx);
+    parlay::sequence<kmer_t> new_keys;
+    parlay::sequence<u8> new_values;
+    auto next = std::make_shared<epoch_t>(*std::atomic_load(&epoch));
+    {
+        std::lock_guard<std::mutex> lock(pending_mtx);
+        std::swap(new_keys, keys);
+        std::swap(new_values, values);
+        next->names = headers.names;
+    }
+    const u4 n = new_keys.size();
 
+    std::lock_guard<std::mutex> parlay_lock(external_parlay_mutex());
     auto tuples = parlay::delayed_tabulate(n, [&](size_t i){
-        return std::make_pair(keys[i], i);
+        return std::make_pair(new_keys[i], i);
     });
     const int nsb = n_shard_bits;
-    auto hash = [nsb](const u4 &x) { return SHARD(x, nsb); };
-    auto equal = [nsb](const u4& a, const u4& b) { return SHARD(a, nsb) == SHARD(b, nsb); };
+    auto hash = [nsb](const kmer_t &x) { return SHARD(x, nsb); };
+    auto equal = [nsb](const kmer_t& a, const kmer_t& b) { return SHARD(a, nsb) == SHARD(b, nsb); };
     auto grouped = parlay::group_by_key(tuples, hash, equal);
 
+    /// touched shards are rebuilt into new versions, searches of the current epoch keep reading the old ones
     parlay::for_each(parlay::iota(grouped.size()), [&](size_t i){
         auto shard_id = (SHARD(grouped[i].first, nsb));
-        put_in_shard(shards[shard_id], keys, values, grouped[i].second);
+        auto shard = std::make_shared<shard_t>(n_keys_per_shard+1);
+        put_in_shard(*next->shards[shard_id], *shard, new_keys, new_values, grouped[i].second);
+        next->shards[shard_id] = std::move(shard);
     });
-    keys.clear();
-    values.clear();
+    std::atomic_store(&epoch, std::shared_ptr<const epoch_t>(std::move(next)));
 }
 
-std::tuple<const char *, u4, float> dindex_t::search(parlay::slice<char *, char *> seq) {
-    const auto i = parlay::worker_id();
-    auto &hh = hhs[i];
+void dindex_t::merge_async() {
+    wait_merge();
+    merger = std::thread([this]() { merge(); });
+}
+
+void dindex_t::wait_merge() {
+    if (merger.joinable()) merger.join();
+}
+
+std::tuple<const char *, u4, float> dindex_t::search(parlay::slice<const char*, const char*> seq) {
+    const auto e = std::atomic_load(&epoch);
+    return search(*e, seq);
+}
+
+/**
+ * Vote table and scratch buffers of the calling thread.
+ * The dynamic index is searched from threads outside the parlay pool, such as Python threads that released the GIL,
+ * whose worker ids collide, so the search state belongs to the thread rather than to a worker.
+ */
+struct dsearch_state_t {
+    heavyhitter_ht_t<u8> hh;
+    search_scratch_t scratch;
+};
+
+static dsearch_state_t& dsearch_state() {
+    thread_local dsearch_state_t state;
+    return state;
+}
+
+std::tuple<const char *, u4, float> dindex_t::search(const epoch_t &e, parlay::slice<const char*, const char*> seq) {
+    auto &s = dsearch_state().scratch;
+    create_kmers_1t(seq, k, sigma, encode_dna, s.keys);
+    const auto [header, fwd, pos, presence] = search_kmers(e, s, false);
+    return std::make_tuple(header, pos, presence);
+}
+
+std::tuple<const char *, bool, u4, float> dindex_t::search_kmers(const epoch_t &e, search_scratch_t &s, bool both_strands) {
+    auto &hh = dsearch_state().hh;
     hh.reset();
-    parlay::sequence<u4> keys = create_kmers_1t(seq, k, sigma, encode_dna);
-    for (u4 j = 0; j < keys.size(); ++j) {
-        const auto &[vbegin, vend] = get(keys[j]);
-        for (auto v = vbegin; v != vend; ++v) {
-            u8 ref_id = get_id_from(*v);
-            u8 ref_pos = get_pos_from(*v);
-            u8 intercept = (ref_pos > j) ? (ref_pos - j) : 0;
-            intercept /= bandwidth;
-            u8 key = make_key_from(ref_id, intercept);
-            hh.insert(key);
-            if (intercept >= bandwidth) {
-                intercept -= bandwidth;
-                key = make_key_from(ref_id, intercept);
+    /// votes of both strands go to the same counter, tagged with the strand in the lowest bit of the diagonal
+    for (u8 rev = 0; rev < (both_strands ? 2 : 1); ++rev) {
+        const auto &keys = rev ? s.rc_keys : s.keys;
+        for (u4 j = 0; j < keys.size(); ++j) {
+            const auto &[vbegin, vend] = get(e, keys[j]);
+            for (auto v = vbegin; v != vend; ++v) {
+                u8 ref_id = get_id_from(*v);
+                u8 ref_pos = get_pos_from(*v);
+                u8 intercept = (ref_pos > j) ? (ref_pos - j) : 0;
+                intercept /= bandwidth;
+                u8 key = make_key_from(ref_id, (intercept << 1) | rev);
                 hh.insert(key);
+                if (intercept >= bandwidth) {
+                    intercept -= bandwidth;
+                    key = make_key_from(ref_id, (intercept << 1) | rev);
+                    hh.insert(key);
+                }
             }
         }
     }
     if (hh.top_key != -1) {
-        float presence = (hh.top_count * 1.0) / keys.size();
-        if (presence < presence_fraction) return {"*", 0, 0.0f};
-        auto id = get_id_from(hh.top_key);
-        auto &header = headers.get_name(id);
-        return std::make_tuple(header.c_str(), get_pos_from(hh.top_key) * bandwidth, presence);
-    } else return {"*", 0, 0.0f};
+        /// both strands have as many k-mers
+        float presence = (hh.top_count * 1.0) / s.keys.size();
+        if (presence < presence_fraction) return {"*", true, 0, 0.0f};
+        const u8 diagonal = get_pos_from(hh.top_key);
+        auto &header = *e.names[get_id_from(hh.top_key)];
+        return std::make_tuple(header.c_str(), !(diagonal & 1), (diagonal >> 1) * bandwidth, presence);
+    } else return {"*", true, 0, 0.0f};
 }
 
-void dindex_t::put_in_shard(shard_t &shard,  parlay::sequence<u4> &all_new_keys, parlay::sequence<u8> &all_new_values,
-                            parlay::sequence<u8> &my_indices) {
-    u4 p = my_indices.size();
-    parlay::sequence<u4> my_keys(p);
-    parlay::sequence<u8> my_values(p);
-    for (u4 i = 0, off = 0; i < p; ++i) {
-        my_keys[off] = SKEY(all_new_keys[my_indices[i]], n_shard_bits);
-        my_values[off++] = all_new_values[my_indices[i]];
-    }
-    simple_sort_by_key(my_keys, my_values);
+/**
+ * Rebuild a shard with new values. The new values are bucketed by key, and each key's old values are followed by its
+ * new ones, so the cost is linear in the size of the shard.
+ */
+void dindex_t::put_in_shard(const shard_t &old_shard, shard_t &shard, parlay::sequence<kmer_t> &all_new_keys,
+                            parlay::sequence<u8> &all_new_values, parlay::sequence<u8> &my_indices) {
+    const size_t p = my_indices.size(), n_old = old_shard.values.size();
 
-    // compute delta array
-    parlay::sequence<u4> delta(n_keys_per_shard+1, 0);
-    for (const auto& key : my_keys) {
-        delta[key]++;
+    // bucket the new values by key
+    parlay::sequence<u8> new_offsets(n_keys_per_shard+1, 0);
+    for (const auto &i : my_indices) new_offsets[SKEY(all_new_keys[i], n_shard_bits)]++;
+    std::exclusive_scan(new_offsets.begin(), new_offsets.end(), new_offsets.begin(), 0ul);
+    parlay::sequence<u8> my_values(p);
+    {
+        auto fill = new_offsets;
+        for (const auto &i : my_indices) my_values[fill[SKEY(all_new_keys[i], n_shard_bits)]++] = all_new_values[i];
     }
 
-    parlay::sequence<u8> new_offsets(n_keys_per_shard+1);
-    std::exclusive_scan(delta.begin(), delta.end(), new_offsets.begin(), 0);
-
-    auto &values = shard.values;
-    for (u4 i=0; i < p; ++i) {
-        u4 off = new_offsets[my_keys[i]];
-        values.insert(off, my_values[i]);
+    // combine offsets and merge values
+    auto &old_offsets = old_shard.offsets;
+    auto &offsets = shard.offsets;
+    for (u8 x = 0; x <= n_keys_per_shard; ++x) offsets[x] = old_offsets[x] + new_offsets[x];
+    shard.values = parlay::sequence<u8>::uninitialized(n_old + p);
+    for (u8 x = 0; x < n_keys_per_shard; ++x) {
+        auto out = shard.values.begin() + offsets[x];
+        out = std::copy(old_shard.values.begin() + old_offsets[x], old_shard.values.begin() + old_offsets[x+1], out);
+        std::copy(my_values.begin() + new_offsets[x], my_values.begin() + new_offsets[x+1], out);
     }
-
-    // update offsets
-    auto &old_offsets = shard.offsets;
-    std::copy(new_offsets.begin(), new_offsets.end(), old_offsets.begin());
 }
 
-pair<dindex_t::iterator_t, dindex_t::iterator_t> dindex_t::get(u4 key) {
+pair<const u8*, const u8*> dindex_t::get(const epoch_t &e, kmer_t key) {
     u4 shard_id = SHARD(key, n_shard_bits);
-    auto &shard = shards[shard_id];
+    auto &shard = *e.shards[shard_id];
     auto begin = shard.offsets[SKEY(key, n_shard_bits)], end = shard.offsets[SKEY(key, n_shard_bits) + 1];
-    return {dindex_t::iterator_t(shard.values, begin), dindex_t::iterator_t(shard.values, end)};
-
+    return {shard.values.data() + begin, shard.values.data() + end};
 }
 
-std::tuple<const char *, bool, u4, float> dindex_t::search(string &seq) {
+std::tuple<const char *, bool, u4, float> dindex_t::search(std::string_view seq) {
     if (seq.length() > 2 * k) {
-        const auto [header1, pos1, support1] =
-                search(parlay::make_slice(seq.data(), seq.data() + seq.size()));
-        auto slice = parlay::make_slice(seq.rbegin(), seq.rend());
-        auto rc = parlay::map(slice, [](char c) {
-            return "TGAC"[(c >> 1) & 3];
-        });
-        const auto [header2, pos2, support2] =
-                search(parlay::make_slice(rc.begin(), rc.end()));
-        if (support1 >= support2)
-            return std::make_tuple(header1, true, pos1, support1);
-        else
-            return std::make_tuple(header2, false, pos2, support2);
+        const auto e = std::atomic_load(&epoch);    /// both strands are searched in the same epoch
+        auto &s = dsearch_state().scratch;
+        create_kmers_both_1t(seq, k, s.keys, s.rc_keys);
+        return search_kmers(*e, s, true);
     } else return {"*", true, 0, 0.0f};
 }
 
@@ -423,6 +1076,7 @@ void cj_index_t::build() {
     value_offsets.clear();
     parlay::sequence<u8> tmp;
     value_offsets.swap(tmp);
+    offsets = nullptr;
     c_values = ev_t(q_values);
     log_info("Compressed values from %s to %s",
              format_size(q_values.size() * 4.0).c_str(), format_size(sdsl::size_in_bytes(c_values)).c_str());
@@ -431,13 +1085,15 @@ void cj_index_t::build() {
     log_info("Memory usage after compression: %s", get_memory_usage().c_str());
 }
 
-std::tuple<const char *, u4, float> cj_index_t::search(parlay::slice<char *, char *> seq) {
+std::tuple<const char *, u4, float> cj_index_t::search(parlay::slice<const char*, const char*> seq) {
     const auto i = parlay::worker_id();
     auto &hh = hhs[i];
     hh.reset();
-    parlay::sequence<u4> keys = create_kmers_1t(seq, k, sigma, encode_dna);
+    auto &keys = scratch[i].keys;
+    create_kmers_1t(seq, k, sigma, encode_dna, keys);
     for (auto key : keys) {
         const auto start = c_val_offsets[key], end = c_val_offsets[key+1];
+        if (end - start > mask_occ) continue;
         for (auto j = start; j < end; ++j) hh.insert(c_values[j]);
     }
     if (hh.top_key != -1) {
@@ -450,19 +1106,118 @@ std::tuple<const char *, u4, float> cj_index_t::search(parlay::slice<char *, cha
     } else return {"*", 0, 0.0f};
 }
 
-void cj_index_t::dump(std::ostream &fs) {
-    dump_headers(fs, headers);
-    c_val_offsets.serialize(fs);
-    c_values.serialize(fs);
-    dump_values(fs, max_occ);
-    dump_seq(fs, frag_offsets);
+void cj_index_t::dump(cidx_writer_t &fs) {
+    dump_headers(fs, headers, ref_lengths);
+    c_val_offsets.serialize(fs.begin(SEC_C_OFFSETS));
+    fs.end();
+    c_values.serialize(fs.begin(SEC_C_VALUES));
+    fs.end();
+    dump_values(fs.begin(SEC_STATS), max_occ);
+    fs.end();
+    dump_seq(fs.begin(SEC_FRAGMENTS), frag_offsets);
+    fs.end();
 }
 
-void cj_index_t::load(std::istream &fs) {
-    load_headers(fs, headers);
-    c_val_offsets.load(fs);
-    c_values.load(fs);
-    load_values(fs, &max_occ);
-    load_seq(fs, frag_offsets);
+void cj_index_t::load(cidx_reader_t &fs) {
+    load_headers(fs, headers, ref_lengths);
+    auto c_offsets_fs = fs.istream(SEC_C_OFFSETS);
+    c_val_offsets.load(c_offsets_fs);
+    auto c_values_fs = fs.istream(SEC_C_VALUES);
+    c_values.load(c_values_fs);
+    auto stats = fs.section(SEC_STATS);
+    load_values(stats, &max_occ);
+    auto fragments = fs.section(SEC_FRAGMENTS);
+    load_seq(fragments, frag_offsets);
     log_info("Memory usage = %s.", get_memory_usage().c_str());
-}
\ No newline at end of file
+}
+
+/**
+ * Postings of a compressed coordinate index, decoded one block at a time
+ */
+struct varbyte_postings_t {
+    const u1 *blocks;
+    const u8 *skips;
+    u8 *buf;                                    /// room for a block of postings
+    inline void prefetch(const u8 b) const { __builtin_prefetch(blocks + skips[b / CC_BLOCK_SZ]); }
+    template <typename F>
+    inline void for_each(const u8 b, const u8 e, F f) const {
+        u8 v = 0;       /// b is the head of a list, whose gap is the posting itself
+        for (u8 blk = b / CC_BLOCK_SZ; blk * CC_BLOCK_SZ < e; ++blk) {
+            const u8 first = blk * CC_BLOCK_SZ, last = std::min(e, first + CC_BLOCK_SZ);
+            /// postings past the end of the list are not decoded, those before its head in the block have to be
+            vbyte_uncompress_unsorted64(blocks + skips[blk], buf, last - first);
+            for (u8 j = std::max(b, first) - first; j < last - first; ++j) f(v += buf[j]);
+        }
+    }
+};
+
+void cc_index_t::build() {
+    c_index_t::build();
+    log_info("Compressing values..");
+    n_values = p_values.size();
+    const size_t n_blocks = (n_values + CC_BLOCK_SZ - 1) / CC_BLOCK_SZ;
+    /// the heads of the lists are stored as they are, the other postings as the gap to the previous one
+    parlay::sequence<bool> heads(n_values, false);
+    for_each_list([&](u8 b, u8 e) { heads[b] = true; });
+    auto gaps_of = [&](size_t blk, u8 *gaps) {
+        const size_t first = blk * CC_BLOCK_SZ, n = std::min<size_t>(CC_BLOCK_SZ, n_values - first);
+        for (size_t i = first; i < first + n; ++i)
+            gaps[i - first] = heads[i] ? p_values[i] : p_values[i] - p_values[i - 1];
+        return n;
+    };
+
+    /// size the blocks first, so that they can be coded in parallel straight to their place
+    c_skips = parlay::tabulate(n_blocks + 1, [&](size_t blk) -> u8 {
+        if (blk == n_blocks) return 0;
+        u8 gaps[CC_BLOCK_SZ];
+        const size_t n = gaps_of(blk, gaps);
+        return vbyte_compressed_size_unsorted64(gaps, n);
+    });
+    const u8 n_bytes = parlay::scan_inplace(c_skips);
+    c_values = parlay::sequence<u1>(n_bytes + CC_PADDING, 0);
+    parlay::parallel_for(0, n_blocks, [&](size_t blk) {
+        u8 gaps[CC_BLOCK_SZ];
+        const size_t n = gaps_of(blk, gaps);
+        vbyte_compress_unsorted64(gaps, c_values.data() + c_skips[blk], n);
+    });
+    blocks = c_values.data(), skips = c_skips.data();
+    log_info("Compressed values from %s to %s (%s of which is the skip table)",
+             format_size(p_values.size_in_bytes()).c_str(), format_size(n_bytes + c_skips.size() * 8).c_str(),
+             format_size(c_skips.size() * 8).c_str());
+    p_values = packed_array_t();
+}
+
+std::tuple<const char *, bool, u4, float> cc_index_t::search_kmers(search_scratch_t &s, bool both_strands) {
+    s.postings.resize(CC_BLOCK_SZ);
+    return vote_kmers(s, both_strands, varbyte_postings_t{blocks, skips, s.postings.data()});
+}
+
+void cc_index_t::dump(cidx_writer_t &fs) {
+    dump_headers(fs, headers, ref_lengths);
+    dump_offsets(fs, value_offsets, ef_offsets);
+    log_info("Dumping compressed values..");
+    auto &section = fs.begin(SEC_BLOCK_SKIPS);
+    dump_values(section, pos_nbits, n_values);
+    dump_aligned_seq(section, c_skips);
+    fs.end();
+    dump_aligned_seq(fs.begin(SEC_VARBYTE_VALUES), c_values);
+    fs.end();
+    dump_values(fs.begin(SEC_STATS), max_occ);
+    fs.end();
+    log_info("Done.");
+}
+
+void cc_index_t::load(cidx_reader_t &fs) {
+    mapping = fs.mapping();
+    load_headers(fs, headers, ref_lengths);
+    map_offsets(fs, offsets, ef_offsets);
+    log_info("Mapping compressed values..");
+    auto section = fs.section(SEC_BLOCK_SKIPS);
+    load_values(section, &pos_nbits, &n_values);
+    skips = map_aligned_seq<u8>(section).first;
+    auto values_section = fs.section(SEC_VARBYTE_VALUES);
+    blocks = map_aligned_seq<u1>(values_section).first;
+    auto stats = fs.section(SEC_STATS);
+    load_values(stats, &max_occ);
+    log_info("Done.");
+}
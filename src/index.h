@@ -9,10 +9,16 @@
 #include "parlay_utils.h"
 #include "cqueue.h"
 #include "cqutils.h"
+#include "cqruns.h"
 #include "hash_table8.hpp"
 #include "utils.h"
 #include "config.h"
-#include "templated_tiered.h"
+#include "mmfile.h"
+#include "cidx.h"
+#include "packed.h"
+#include <mutex>
+#include <thread>
+#include <string_view>
 #include "sdsl/vectors.hpp"
 
 #ifdef NDEBUG
@@ -22,8 +28,10 @@
 #endif
 
 
+#ifdef HH_EMHASH8
 /**
- * A simple frequency counter
+ * The previous frequency counter, a general-purpose hash map that is cleared between queries.
+ * It is only built with -DHH_EMHASH8=ON, to benchmark the vote table against it (see scratch/bench_votes.sh).
  * @tparam T key type
  */
 template <typename T>
@@ -38,6 +46,166 @@ struct heavyhitter_ht_t {
     }
     void reset() { counts.clear(), top_key=-1, top_count = 0; }
 };
+#else
+/**
+ * A frequency counter that finds the most frequent key, used to accumulate votes during search.
+ * It is an open-addressing table with linear probing whose slots are stamped with a generation, so resetting it
+ * between queries is O(1) no matter how large it has grown.
+ * @tparam T key type
+ */
+#define HH_INIT_CAPACITY (1<<12)
+template <typename T>
+struct heavyhitter_ht_t {
+    struct slot_t {
+        T key;
+        u4 count;
+        u4 gen;
+    };
+    std::vector<slot_t> slots;
+    u4 gen = 1, n_bits = 0;
+    size_t n_used = 0;
+    T top_key = -1;
+    u4 top_count = 0;
+
+    heavyhitter_ht_t() { resize(HH_INIT_CAPACITY); }
+
+    inline size_t slot_of(const T key) const {
+        return (size_t)(((u8)key * 0x9E3779B97F4A7C15ULL) >> (64 - n_bits));
+    }
+
+    void resize(size_t capacity) {
+        std::vector<slot_t> old = std::move(slots);
+        slots.assign(capacity, slot_t{0, 0, 0});
+        n_bits = __builtin_ctzll(capacity);
+        const size_t mask = capacity - 1;
+        for (auto &s : old) if (s.gen == gen) {
+            size_t i = slot_of(s.key);
+            while (slots[i].gen == gen) i = (i + 1) & mask;
+            slots[i] = s;
+        }
+    }
+
+    /**
+     * Count a key. Like `counts[key]++` followed by updating the top key if the count before the increment was the
+     * highest seen so far.
+     */
+    inline void insert(const T key) {
+        const size_t mask = slots.size() - 1;
+        size_t i = slot_of(key);
+        while (true) {
+            auto &s = slots[i];
+            if (s.gen != gen) {
+                s = {key, 1, gen};
+                if (++n_used * 2 > slots.size()) resize(slots.size() * 2);
+                return;
+            }
+            if (s.key == key) {
+                u4 count = s.count++;
+                if (count > top_count)
+                    top_count = count, top_key = key;
+                return;
+            }
+            i = (i + 1) & mask;
+        }
+    }
+
+    void reset() {
+        if (++gen == 0) {       /// the generation wrapped around, so stale stamps could look current
+            for (auto &s : slots) s.gen = 0;
+            gen = 1;
+        }
+        n_used = 0, top_key = -1, top_count = 0;
+    }
+};
+#endif
+
+typedef sdsl::sd_vector<> ef_t;
+
+/**
+ * Elias-Fano coded offsets of the posting lists.
+ * Only the keys that have a posting list are stored, so a list takes about 2 + log2(#keys / #lists) bits to find its
+ * key and 2 + log2(#values / #lists) bits to find its postings, and the offsets can be encoded from the keys that
+ * occur without ever holding dense offsets over all keys.
+ */
+struct ef_offsets_t {
+    ef_t keys;                                  /// the keys that have a posting list
+    ef_t::rank_1_type rank;
+    ef_t offsets;                               /// the r-th set bit is at the offset of the r-th list plus r
+    ef_t::select_1_type select;
+
+    ef_offsets_t() = default;
+    ef_offsets_t(const ef_offsets_t&) = delete;
+    ef_offsets_t& operator = (const ef_offsets_t&) = delete;
+
+    /**
+     * @param n_keys number of possible keys
+     * @param n_lists number of keys that have a posting list
+     * @param n_values total length of the posting lists
+     * @param visit calls its argument with the key and the length of every list, in ascending order of the keys
+     */
+    template <typename F>
+    void encode(u8 n_keys, u8 n_lists, u8 n_values, F visit) {
+        sdsl::sd_vector_builder key_builder(n_keys, n_lists), offset_builder(n_values + n_lists + 1, n_lists + 1);
+        u8 offset = 0, r = 0;
+        visit([&](u8 key, u8 length) {
+            key_builder.set(key);
+            offset_builder.set(offset + r);
+            offset += length, ++r;
+        });
+        expect(r == n_lists && offset == n_values);
+        offset_builder.set(offset + r);
+        keys = ef_t(key_builder);
+        offsets = ef_t(offset_builder);
+        init_support();
+    }
+
+    void init_support() {
+        rank.set_vector(&keys);
+        select.set_vector(&offsets);
+    }
+
+    inline u8 n_lists() const { return rank(keys.size()); }
+
+    /**
+     * @return the range [begin, end) of the r-th posting list in the values
+     */
+    inline std::pair<u8, u8> list(const u8 r) const { return {select(r + 1) - r, select(r + 2) - r - 1}; }
+
+    /**
+     * @return the range [begin, end) of the posting list of a key in the values, empty if the key has none
+     */
+    inline std::pair<u8, u8> range(const u8 key) const {
+        if (!keys[key]) return {0, 0};
+        return list(rank(key));
+    }
+
+    void serialize(std::ostream &fs) const {
+        keys.serialize(fs);
+        offsets.serialize(fs);
+    }
+
+    void load(std::istream &fs) {
+        keys.load(fs);
+        offsets.load(fs);
+        init_support();
+    }
+
+    inline size_t size_in_bytes() const { return sdsl::size_in_bytes(keys) + sdsl::size_in_bytes(offsets); }
+};
+
+/**
+ * Buffers of a worker that are reused by its searches, so that a search does not allocate once they have grown to
+ * fit the longest read
+ */
+struct search_scratch_t {
+    std::vector<kmer_t> keys, rc_keys;          /// k-mers of the query and of its reverse complement
+    std::vector<u4> positions, rc_positions;    /// positions of the sampled k-mers
+    std::vector<u1> strands;                    /// whether a canonical k-mer is the reverse complement of the query's
+    std::vector<u8> hashes;                     /// sampling order of the k-mers
+    std::vector<std::pair<u8, u8>> ranges;      /// posting lists of the seeds
+    std::vector<u8> postings;                   /// a decoded block of a compressed posting list
+    std::string rc;                             /// reverse complement of the query
+};
 
 /**
  * An interface for an index
@@ -45,23 +213,105 @@ struct heavyhitter_ht_t {
 class index_t {
 protected:
     std::vector<std::string> headers;
-    u4 max_occ = -1;
+    std::vector<u8> ref_lengths;                /// empty if the index was written without them
+    u4 max_occ = -1;                            /// posting list length at the --occ-pct percentile
+    u4 mask_occ = -1;                           /// search skips k-mers with more postings than this
     parlay::sequence<u8> value_offsets;
+    const u8 *offsets = nullptr;                /// points to value_offsets or into a memory-mapped index
+    ef_offsets_t ef_offsets;                    /// used instead when `offsets` is null
+    std::shared_ptr<mmap_file_t> mapping;       /// keeps the mapped index alive for as long as we use it
+    search_scratch_t *scratch = nullptr;        /// one per worker, allocated with the query buffers
 
-    const u4 k, sigma, n_keys;
+    const u4 k, sigma;
+    const u8 n_keys;
     const u4 bandwidth;
     const bool fwd_rev;
+    const bool canonical;                       /// k-mers are stored as the smaller of them and their reverse complements
     const float presence_fraction;
     const u8 sort_blocksz;
+    const bool counting_sort;
+    const u8 build_mem;                         /// spill sorted runs to disk when buffered tuples exceed this many bytes
+    const float occ_pct;
+    const bool drop_occ;
+    const u4 occ_threshold;                     /// user-given occurrence threshold, 0 to use max_occ
+    bool use_ef_offsets;
 
     index_t();
 
+    /**
+     * @return the range [begin, end) of the posting list of a key in the values
+     */
+    inline std::pair<u8, u8> key_range(const u8 key) const {
+        if (offsets) return {offsets[key], offsets[key+1]};
+        return ef_offsets.range(key);
+    }
+
+    /**
+     * Call f(begin, end) in parallel for the posting list of every key that has one
+     */
+    template <typename F>
+    void for_each_list(F f) const {
+        if (offsets) parlay::parallel_for(0, n_keys, [&](size_t key) {
+            if (offsets[key] < offsets[key+1]) f(offsets[key], offsets[key+1]);
+        });
+        else parlay::parallel_for(0, ef_offsets.n_lists(), [&](size_t r) {
+            const auto [b, e] = ef_offsets.list(r);
+            f(b, e);
+        });
+    }
+
+    /**
+     * Replace the dense offsets of the posting lists by Elias-Fano coded ones.
+     * This shrinks the index but not the peak memory of the build; only building by counting needs it, the other
+     * builds encode the offsets straight from the keys with `consolidate_sparse`.
+     */
+    void compress_offsets();
+
+    /**
+     * Group the buffered tuples by key into posting lists, dropping overfull ones with --drop-occ, and encode their
+     * offsets with Elias-Fano from the keys that occur, so that the build never holds dense offsets over all keys
+     * @param runs spilled runs, merged with the tuples still in memory if there are any
+     * @param q_keys buffered keys, emptied
+     * @param q_values buffered values, replaced by the posting lists
+     * @return the posting list length at the --occ-pct percentile
+     */
+    template <typename K, typename V>
+    u4 consolidate_sparse(cq_runs_t<K, V> &runs, cqueue_t<K> &q_keys, cqueue_t<V> &q_values);
+
+    /**
+     * Allocate the search scratch buffers of all workers
+     */
+    void init_scratch() {
+        if (!scratch) scratch = new search_scratch_t[parlay::num_workers()];
+    }
+
 public:
     index_t(config_t &config):
-        k(config.k), sigma(config.sigma), fwd_rev(config.fwd_rev), sort_blocksz(config.sort_block_size),
-        presence_fraction(config.presence_fraction), bandwidth(config.bandwidth), n_keys(1<<(config.k<<1)) {}
+        k(config.k), sigma(config.sigma), fwd_rev(config.fwd_rev), canonical(config.canonical), sort_blocksz(config.sort_block_size),
+        presence_fraction(config.presence_fraction), bandwidth(config.bandwidth), n_keys(ipow(config.sigma, config.k)),
+        counting_sort(config.counting_sort), build_mem(config.build_mem), occ_pct(config.occ_pct),
+        drop_occ(config.drop_occ), occ_threshold(config.max_occ), use_ef_offsets(config.ef_offsets) {}
     virtual ~index_t() {}
 
+    /**
+     * Skip high-frequency k-mers when searching, which bounds the work per read in repetitive references
+     * @param limit k-mers with more postings than this are skipped; 0 to use the threshold stored in the index
+     */
+    void mask_occurrences(u4 limit = 0) {
+        mask_occ = limit ? limit : max_occ;
+        log_info("Masking k-mers with more than %u occurrences.", mask_occ);
+    }
+
+    /**
+     * @return reference headers, as returned by `search`
+     */
+    inline const std::vector<std::string>& reference_names() const { return headers; }
+
+    /**
+     * @return lengths of the references in the order of their headers, or an empty vector if the index has none
+     */
+    inline const std::vector<u8>& reference_lengths() const { return ref_lengths; }
+
     /**
      * Initialize buffers for query client
      */
@@ -83,7 +333,26 @@ public:
      * (3) fraction of k-mers supporting the match
      * ]
      */
-    virtual std::tuple<const char*, u4, float> search(parlay::slice<char*, char*> seq) = 0;
+    virtual std::tuple<const char*, u4, float> search(parlay::slice<const char*, const char*> seq) = 0;
+
+    /**
+     * Search for a quantized raw signal in the index
+     * @param qsig a parlay slice view of the quantized events of a read
+     * @return same as `search`
+     */
+    virtual std::tuple<const char*, u4, float> search_signal(parlay::slice<u1*, u1*> qsig) {
+        log_error("This index does not support raw signal queries.");
+        return {"*", 0, 0.0f};
+    }
+
+    /**
+     * Add a quantized expected signal of a reference to the index
+     * @param name reference header
+     * @param qsig a parlay slice view of the quantized signal
+     */
+    virtual void add_signal(std::string &name, parlay::slice<u1*, u1*> qsig) {
+        log_error("This index can not be built from signals.");
+    }
 
     /**
      * Add a sequence to the index
@@ -112,41 +381,49 @@ public:
      * (4) fraction of k-mers supporting the match
      * ]
      */
-    std::tuple<const char*, bool, u4, float> search(std::string &seq) {
+    std::tuple<const char*, bool, u4, float> search(std::string_view seq) {
         if (seq.length() > 2 * k) {
-            const auto [header1, pos1, support1] =
-                    search(parlay::make_slice(seq.data(), seq.data() + seq.size()));
-            if (fwd_rev) return std::make_tuple(header1, true, pos1, support1);
-            else {
-                auto slice = parlay::make_slice(seq.rbegin(), seq.rend());
-                auto rc = parlay::map(slice, [](char c) {
-                    return "TGAC"[(c >> 1) & 3];
-                });
-                const auto [header2, pos2, support2] =
-                        search(parlay::make_slice(rc.begin(), rc.end()));
-                if (support1 >= support2)
-                    return std::make_tuple(header1, true, pos1, support1);
-                else
-                    return std::make_tuple(header2, false, pos2, support2);
-            }
+            auto slice = parlay::make_slice(seq.data(), seq.data() + seq.size());
+            if (fwd_rev && !canonical) {
+                const auto [header, pos, support] = search(slice);
+                return std::make_tuple(header, true, pos, support);
+            } else return search_both(slice);
         } else return {"*", true, 0, 0.0f};
     }
+
+    /**
+     * Search for a sequence and its reverse complement in the index
+     * @param seq a parlay slice view of a query sequence
+     * @return same as `search(std::string_view)`
+     */
+    virtual std::tuple<const char*, bool, u4, float> search_both(parlay::slice<const char*, const char*> seq) {
+        const auto [header1, pos1, support1] = search(seq);
+        auto &rc = scratch[parlay::worker_id()].rc;
+        revcmp(seq.begin(), seq.size(), rc);
+        const auto [header2, pos2, support2] = search(parlay::make_slice(rc.c_str(), rc.c_str() + rc.size()));
+        if (support1 >= support2)
+            return std::make_tuple(header1, true, pos1, support1);
+        else
+            return std::make_tuple(header2, false, pos2, support2);
+    }
+
     /**
      * Build the index after adding all reference sequences
      */
     virtual void build() = 0;
 
     /**
-     * Dump index into file
-     * @param fp file handle which allows writing
+     * Dump index into the sections of an index file
+     * @param f writer of the index container
      */
-    virtual void dump(std::ostream &f) = 0;
+    virtual void dump(cidx_writer_t &f) = 0;
 
     /**
-     * Load index from file
-     * @param fp file handle that allows reading
+     * Load index from the sections of an index file.
+     * Large arrays are memory-mapped where possible instead of being copied.
+     * @param f reader of the index container
      */
-    virtual void load(std::istream &f) = 0;
+    virtual void load(cidx_reader_t &f) = 0;
 
 };
 
@@ -155,24 +432,23 @@ public:
  */
 class j_index_t : public index_t {
 protected:
-    cqueue_t<u4> q_keys;
+    cqueue_t<kmer_t> q_keys;
     cqueue_t<u4> q_values;
+    cq_runs_t<kmer_t, u4> runs;
     heavyhitter_ht_t<u4> *hhs = nullptr;
     std::vector<u4> frag_offsets = {0};
     u4 frag_len, frag_ovlp_len;
 
-    inline std::pair<cqueue_t<u4>::const_iterator, cqueue_t<u4>::const_iterator> get(u4 key) {
-        return { q_values.it(value_offsets[key]), q_values.it(value_offsets[key+1]) };
-    }
-
 public:
-    explicit j_index_t(config_t &config): index_t(config), frag_len(config.jc_frag_len), frag_ovlp_len(config.jc_frag_ovlp_len) {}
+    explicit j_index_t(config_t &config): index_t(config), frag_len(config.jc_frag_len), frag_ovlp_len(config.jc_frag_ovlp_len) {
+        runs.set_dir(config.tmp_dir);
+    }
     void add(std::string &name, parlay::slice<char*, char*> seq) override;
-    std::tuple<const char*, u4, float> search(parlay::slice<char*, char*> seq) override;
+    std::tuple<const char*, u4, float> search(parlay::slice<const char*, const char*> seq) override;
     void init_query_buffers() override;
     void build() override;
-    void dump(std::ostream &f) override;
-    void load(std::istream &f) override;
+    void dump(cidx_writer_t &f) override;
+    void load(cidx_reader_t &f) override;
 };
 
 /**
@@ -185,30 +461,122 @@ protected:
     ev_t c_values;
 
 public:
-    explicit cj_index_t(config_t &config): j_index_t(config) {}
+    explicit cj_index_t(config_t &config): j_index_t(config) {
+        use_ef_offsets = false;     /// the offsets are compressed anyway
+    }
     void build() override;
-    std::tuple<const char*, u4, float> search(parlay::slice<char*, char*> seq) override;
-    void dump(std::ostream &f) override;
-    void load(std::istream &f) override;
+    std::tuple<const char*, u4, float> search(parlay::slice<const char*, const char*> seq) override;
+    void dump(cidx_writer_t &f) override;
+    void load(cidx_reader_t &f) override;
 };
 
 class c_index_t : public index_t {
-    cqueue_t<u4> q_keys;
-    cqueue_t<u8> q_values;
+protected:
+    cqueue_t<kmer_t> q_keys;
+    cqueue_t<u8> q_values;                      /// coordinates added so far, emptied by `build`
+    packed_array_t p_values;                    /// coordinates packed to the bits the references need
+    u4 pos_nbits = 0;                           /// bits of the position in a packed coordinate, below the reference id
+    cq_runs_t<kmer_t, u8> runs;
     heavyhitter_ht_t<u8> *hhs = nullptr;
+    const config_t::sampling_t sampling;
+    const int sampling_w, syncmer_s;
 
-    inline std::pair<cqueue_t<u8>::const_iterator, cqueue_t<u8>::const_iterator> get(u4 key) {
-        return { q_values.it(value_offsets[key]), q_values.it(value_offsets[key+1]) };
-    }
+    /**
+     * Pick the k-mers to index or look up according to the sampling scheme
+     * @param kmers all k-mers of a sequence
+     * @return positions of the sampled k-mers in ascending order
+     */
+    parlay::sequence<u4> sample(const parlay::sequence<kmer_t> &kmers) const;
+
+    /**
+     * Like `sample`, but sequentially and into a reused buffer
+     * @param hashes scratch space
+     */
+    void sample(const std::vector<kmer_t> &kmers, std::vector<u4> &positions, std::vector<u8> &hashes) const;
+
+    /**
+     * Add the (sampled) k-mers of a reference with their coordinates
+     * @param length length of the reference, in the unit of the coordinates
+     * @param strands for canonical k-mers, whether each is the reverse complement of the reference's k-mer
+     */
+    void add_kmers(std::string &name, size_t length, const parlay::sequence<kmer_t> &kmers,
+                   const parlay::sequence<u1> &strands = {});
+
+    /**
+     * Pack the consolidated coordinates into as many bits as the number of references and the longest of them need
+     */
+    void pack_values();
+
+    /**
+     * Vote for diagonals with the (sampled) k-mers of a query, which are in the scratch buffers, and pick the best one
+     * @param both_strands also vote with the k-mers of the reverse complement, into the same counter
+     */
+    virtual std::tuple<const char*, bool, u4, float> search_kmers(search_scratch_t &s, bool both_strands);
+
+    /**
+     * `search_kmers` over any layout of the postings
+     * @tparam P provides `prefetch(b)`, and `for_each(b, e, f)` which calls f on the packed coordinates in [b, e) of a
+     * posting list in order
+     */
+    template <typename P>
+    std::tuple<const char*, bool, u4, float> vote_kmers(search_scratch_t &s, bool both_strands, const P &postings);
 
 public:
-    explicit c_index_t(config_t &config) : index_t(config) {}
+    explicit c_index_t(config_t &config) : index_t(config),
+        sampling(config.sampling), sampling_w(config.sampling_w), syncmer_s(config.syncmer_s) {
+        runs.set_dir(config.tmp_dir);
+    }
     void add(std::string &name, parlay::slice<char*, char*> seq) override;
-    std::tuple<const char*, u4, float> search(parlay::slice<char*, char*> seq) override;
+    std::tuple<const char*, u4, float> search(parlay::slice<const char*, const char*> seq) override;
+    /**
+     * Both strands are searched in one pass: the k-mers of the reverse complement are derived from those of the read
+     * and vote into the same counter
+     */
+    std::tuple<const char*, bool, u4, float> search_both(parlay::slice<const char*, const char*> seq) override;
     void init_query_buffers() override;
     void build() override;
-    void dump(std::ostream &f) override;
-    void load(std::istream &f) override;
+    void dump(cidx_writer_t &f) override;
+    void load(cidx_reader_t &f) override;
+};
+
+/**
+ * A coordinate index over quantized signals, in which a key is a k-mer of SIGNAL_SIGMA-level events.
+ * References are added as expected signals derived from a pore model and queried with events detected in raw
+ * signals, so coordinates are event positions.
+ */
+class s_index_t : public c_index_t {
+public:
+    explicit s_index_t(config_t &config) : c_index_t(config) {}
+    void add(std::string &name, parlay::slice<char*, char*> seq) override;
+    void add_signal(std::string &name, parlay::slice<u1*, u1*> qsig) override;
+    std::tuple<const char*, u4, float> search(parlay::slice<const char*, const char*> seq) override;
+    std::tuple<const char*, bool, u4, float> search_both(parlay::slice<const char*, const char*> seq) override;
+    std::tuple<const char*, u4, float> search_signal(parlay::slice<u1*, u1*> qsig) override;
+};
+
+/**
+ * A coordinate index whose posting lists are compressed.
+ * The postings are cut into blocks of CC_BLOCK_SZ, each varbyte coded on its own, with the first posting of a list
+ * stored as is and the others as the gap to the previous one. A skip table holds where each block starts, so a list
+ * is decoded from the block that holds its head, one block at a time into a per-worker buffer.
+ */
+#define CC_BLOCK_SZ 128
+#define CC_PADDING 16      /// bytes after the last block, which decoders may read past it
+class cc_index_t : public c_index_t {
+protected:
+    parlay::sequence<u1> c_values;
+    parlay::sequence<u8> c_skips;
+    const u1 *blocks = nullptr;                 /// points to c_values or into a memory-mapped index
+    const u8 *skips = nullptr;                  /// byte offset of each block in `blocks`, and their total size
+    u8 n_values = 0;
+
+    std::tuple<const char*, bool, u4, float> search_kmers(search_scratch_t &s, bool both_strands) override;
+
+public:
+    explicit cc_index_t(config_t &config) : c_index_t(config) {}
+    void build() override;
+    void dump(cidx_writer_t &f) override;
+    void load(cidx_reader_t &f) override;
 };
 
 #define N_SHARDS(n_shard_bits)                  (1<<n_shard_bits)
@@ -216,17 +584,22 @@ public:
 #define SHARD(x, n_shard_bits)                  ((x) & (N_SHARDS(n_shard_bits)-1))
 #define SKEY(x, n_shard_bits)                   ((x) >> n_shard_bits)
 
-using namespace Seq;
-typedef Tiered<u8, LayerItr<LayerEnd,Layer<512,Layer<512,Layer<512>>>>> tvec_t;
-
+/**
+ * A dynamic index that references can be added to while it is being searched.
+ * Added sequences are buffered until `merge`, which builds new versions of the shards they touch and publishes them
+ * together with the untouched shards as a new epoch. Searches work on the epoch that was current when they started,
+ * so they never see a half-merged shard, and an epoch is freed when the last search using it is done.
+ */
 class dindex_t {
-    const int k, sigma, bandwidth, n_shard_bits, n_keys, n_shards, n_keys_per_shard;
+    const int k, sigma, bandwidth, n_shard_bits;
+    const u8 n_keys;
+    const int n_shards;
+    const u8 n_keys_per_shard;
     float presence_fraction;
-    parlay::sequence<u4> keys;
+    parlay::sequence<kmer_t> keys;
     parlay::sequence<u8> values;
-    heavyhitter_ht_t<u8> *hhs = nullptr;
     struct headers_t {
-        std::vector<std::string> names;
+        std::vector<std::shared_ptr<const std::string>> names;
         emhash8::HashMap<std::string, u8> name_map; /// header, id, length
         inline std::pair<u4, u4> get_id_offset(std::string &name) {
             if (name_map.contains(name)) {
@@ -236,118 +609,177 @@ class dindex_t {
             } else {
                 u4 id = names.size();
                 name_map[name] = MAKE64(id, 0);
-                names.push_back(name);
+                names.push_back(std::make_shared<const std::string>(name));
                 return {id, 0};
             }
         }
-        inline std::string& get_name(u4 id) { return names[id]; }
     };
     headers_t headers;
+    /**
+     * Values of a shard sorted by key, those of key x being values[offsets[x]..offsets[x+1])
+     */
     struct shard_t {
-        tvec_t values;
+        parlay::sequence<u8> values;
         std::vector<u8> offsets;
         explicit shard_t(size_t n_keys) {
             offsets.resize(n_keys);
             p_fill(offsets.data(), offsets.size(), 0ul);
         }
     };
-    class iterator_t {
-    private:
-        tvec_t &v;
-        size_t i;
-    public:
-        using value_type = u8;
-        using difference_type = size_t;
-        using pointer = u8*;
-        using reference = u8&;
-        using iterator_category = std::forward_iterator_tag;
-
-        // Constructor
-        explicit iterator_t(tvec_t &v, size_t i=0) : v(v), i(i) {}
-
-        // Dereference operator
-        u8 operator*() { return v[i]; }
-
-        // Arrow operator
-        const u8* operator->() { return &(v[i]); }
-
-        // Prefix increment
-        iterator_t& operator++() {
-            ++i;
-            return *this;
-        }
-
-        // Postfix increment
-        iterator_t operator++(int) {
-            iterator_t temp = *this;
-            ++(*this);
-            return temp;
-        }
-
-        // Comparison operators
-        bool operator==(const iterator_t& other) const { return i == other.i; }
-        bool operator!=(const iterator_t& other) const { return i != other.i; }
-        bool operator<(const iterator_t& other) const { return i < other.i; }
-        bool operator<=(const iterator_t& other) const { return i <= other.i; }
-        bool operator>(const iterator_t& other) const { return i > other.i; }
-        bool operator>=(const iterator_t& other) const { return i >= other.i; }
+    /**
+     * An immutable snapshot of the index. Names are never removed, so a header returned by a search stays valid
+     * for as long as the index lives.
+     */
+    struct epoch_t {
+        std::vector<std::shared_ptr<shard_t>> shards;
+        std::vector<std::shared_ptr<const std::string>> names;
     };
-    std::vector<shard_t> shards;
-    void put_in_shard(shard_t &shard, parlay::sequence<u4> &keys, parlay::sequence<u8> &values, parlay::sequence<u8> &indices);
-    std::pair<iterator_t,iterator_t> get(u4 key);
+    std::shared_ptr<const epoch_t> epoch;       /// accessed with std::atomic_load / std::atomic_store
+    std::mutex pending_mtx;                     /// guards keys, values and headers
+    std::mutex merge_mtx;                       /// serializes merges
+    std::thread merger;
+
+    void put_in_shard(const shard_t &old_shard, shard_t &shard, parlay::sequence<kmer_t> &keys, parlay::sequence<u8> &values,
+                      parlay::sequence<u8> &indices);
+    std::pair<const u8*, const u8*> get(const epoch_t &e, kmer_t key);
+    std::tuple<const char*, u4, float> search(const epoch_t &e, parlay::slice<const char*, const char*> seq);
+    /**
+     * Vote for diagonals with the k-mers of a query, which are in the scratch buffers, and pick the best one
+     * @param both_strands also vote with the k-mers of the reverse complement, into the same counter
+     */
+    std::tuple<const char*, bool, u4, float> search_kmers(const epoch_t &e, search_scratch_t &s, bool both_strands);
 
 public:
 
     explicit dindex_t(config_t &config): k(config.k), sigma(config.sigma),
                                          presence_fraction(config.presence_fraction), bandwidth(config.bandwidth),
-                                         n_keys(1<<(config.k<<1)), n_shard_bits(config.n_shard_bits),
+                                         n_keys(((u8)1)<<(config.k<<1)), n_shard_bits(config.n_shard_bits),
                                          n_shards(N_SHARDS(n_shard_bits)), n_keys_per_shard(N_KEYS_PER_SHARD(n_keys, n_shard_bits)) {
+        auto e = std::make_shared<epoch_t>();
         for (int i = 0; i < n_shards; ++i)
-            shards.emplace_back(n_keys_per_shard+1);
-        hhs = new heavyhitter_ht_t<u8>[parlay::num_workers()];
+            e->shards.push_back(std::make_shared<shard_t>(n_keys_per_shard+1));
+        std::atomic_store(&epoch, std::shared_ptr<const epoch_t>(e));
     }
+    ~dindex_t() { wait_merge(); }
 
+    /**
+     * Buffer a sequence to be added to the index by the next merge. Safe to call while searching or merging.
+     * Like `merge`, it runs parallel code while holding `external_parlay_mutex()`, so a caller must not hold it.
+     */
     void add(std::string &name, parlay::slice<char*, char*> seq);
-    std::tuple<const char*, u4, float> search(parlay::slice<char*, char*> seq);
+    std::tuple<const char*, u4, float> search(parlay::slice<const char*, const char*> seq);
+
+    /**
+     * Merge the buffered sequences into the index and publish the result. Safe to call while searching.
+     * Single searches run alongside it, but parallel sections of other threads outside the parlay pool wait for it,
+     * see `external_parlay_mutex`.
+     */
     void merge();
-    std::tuple<const char*, bool, u4, float> search(std::string &seq);
+
+    /**
+     * Like `merge`, but in a background thread. Waits for the previous background merge to finish first.
+     */
+    void merge_async();
+
+    /**
+     * Wait for the background merge, if any, to finish
+     */
+    void wait_merge();
+
+    std::tuple<const char*, bool, u4, float> search(std::string_view seq);
 };
 
 static void dump_index(std::string &filename, config_t &config, index_t *idx) {
     try {
-        auto fs = std::ofstream(filename, std::ios::binary);
-        config.dump_to(fs);
-        idx->dump(fs);
-        fs.close();
+        cidx_writer_t writer(filename);
+        config.dump_to(writer.begin(SEC_CONFIG));
+        writer.end();
+        idx->dump(writer);
+        writer.finish();
     } catch (const std::exception& e) {
         log_error("Could not dump to %s because %s.", filename.c_str(), e.what());
     }
 }
 
-static index_t * load_index(std::string &filename) {
+/**
+ * Load an index from file. The offsets and values of coordinate and jaccard indexes are memory-mapped,
+ * so they are never copied and the pages are shared between processes using the same index.
+ * @param filename path to a .cidx file
+ * @param check verify the checksums of all sections, which reads the whole file
+ */
+static index_t * load_index(std::string &filename, bool check=false) {
     index_t *idx = nullptr;
     try {
-        auto fs = std::ifstream(filename, std::ios::binary);
+        cidx_reader_t reader(filename);
+        if (check) {
+            log_info("Verifying %s..", filename.c_str());
+            if (!reader.verify_checksums()) throw std::runtime_error("the index is corrupt");
+        } else if (!reader.verify_checksums({SEC_CONFIG, SEC_HEADERS})) throw std::runtime_error("the index is corrupt");
         config_t config;
-        config.load_from(fs);
+        auto section = reader.section(SEC_CONFIG);
+        config.load_from(section);
+        if (config.k > MAX_K) throw std::runtime_error("its k is above " + std::to_string(MAX_K) + ", which needs a build with -DWIDE_KMERS=ON");
         if (config.jaccard && config.compressed) {
             log_info("Loading a compressed jaccard index.");
             idx = new cj_index_t(config);
         }
+        else if (config.compressed) {
+            log_info("Mapping a compressed coordinate index.");
+            idx = new cc_index_t(config);
+        }
         else if (config.jaccard) {
-            log_info("Loading a jaccard index.");
+            log_info("Mapping a jaccard index.");
             idx = new j_index_t(config);
         }
+        else if (config.sigma == SIGNAL_SIGMA) {
+            log_info("Mapping a signal index.");
+            idx = new s_index_t(config);
+        }
         else {
-            log_info("Loading a coordinate index.");
+            log_info("Mapping a coordinate index.");
             idx = new c_index_t(config);
         }
-        idx->load(fs);
-        fs.close();
+        idx->load(reader);
     } catch (const std::exception& e) {
         log_error("Could not load from %s because %s.", filename.c_str(), e.what());
     }
     return idx;
 }
 
+/**
+ * Print the layout of an index file without loading the index
+ * @param filename path to a .cidx file
+ * @param check verify the checksums of all sections
+ */
+static void inspect_index(std::string &filename, bool check=false) {
+    try {
+        cidx_reader_t reader(filename);
+        printf("%s: format version %u\n", filename.c_str(), reader.version());
+        printf("%-20s %16s %16s %18s\n", "section", "offset", "size", "checksum");
+        for (const auto &s : reader.table())
+            printf("%-20s %16lu %16lu 0x%016lx\n", cidx_section_name(s.id), s.offset, s.size, s.checksum);
+
+        config_t config;
+        auto section = reader.section(SEC_CONFIG);
+        config.load_from(section);
+        printf("type = %s%s index, k = %d, bandwidth = %d, presence fraction = %.3f, fwd+rev = %s\n",
+               config.compressed ? "compressed " : "",
+               config.jaccard ? "jaccard" : config.sigma == SIGNAL_SIGMA ? "signal" : "coordinate",
+               config.k, config.bandwidth, config.presence_fraction, config.fwd_rev ? "yes" : "no");
+        if (config.canonical) printf("canonical k-mers\n");
+        if (config.sampling == config_t::minimizer) printf("sampling = minimizers, w = %d\n", config.sampling_w);
+        else if (config.sampling != config_t::no_sampling)
+            printf("sampling = %s syncmers, s = %d\n", config.sampling == config_t::open_syncmer ? "open" : "closed",
+                   config.syncmer_s);
+
+        section = reader.section(SEC_HEADERS);
+        size_t n_headers = 0;
+        load_values(section, &n_headers);
+        printf("%zu references\n", n_headers);
+        if (check) printf("checksums %s\n", reader.verify_checksums() ? "OK" : "MISMATCH");
+    } catch (const std::exception& e) {
+        log_error("Could not inspect %s because %s.", filename.c_str(), e.what());
+    }
+}
+
 #endif //COLLINEARITY_INDEX_H
@@ -10,40 +10,51 @@ using namespace klibpp;
 
 void index_fasta(std::string &fasta_filename, index_t *idx) {
     log_info("Beginning indexing..");
-    KSeq record;
-    auto fd = open(fasta_filename.c_str(), O_RDONLY);
-    if (fd < 0) log_error("Could not open %s because %s.", fasta_filename.c_str(), strerror(errno));
-    auto ks = make_kstream(fd, read, mode::in);
+    // references can be whole chromosomes, so they are handed over one at a time
+    fastx_reader_t reader(fasta_filename, 1);
+    fastx_batch_t batch;
 
     u4 ref_id = 0;
-    while (ks >> record) {
-        idx->add(record.name, record.seq);
-        sitrep("processed %u references.", ++ref_id);
+    while (reader.next(batch)) {
+        for (size_t i = 0; i < batch.size(); ++i) {
+            idx->add(batch.names[i], batch.seqs[i]);
+            sitrep("processed %u references.", ++ref_id);
+        }
     }
 
     stderrflush;
-    close(fd);
     idx->build();
 }
 
-void index_fasta_raw(const char* fasta_filename, std::string poremodel, index_t *idx) {
-    throw "Not implemented";
-    const auto [pore_k, pore_levels] = load_pore_model(poremodel);
-    KSeq record;
-    auto fd = open(fasta_filename, O_RDONLY);
-    if (fd < 0) log_error("Could not open %s because %s.", fasta_filename, strerror(errno));
-    auto ks = make_kstream(fd, read, mode::in);
+void index_fasta_raw(std::string &fasta_filename, std::string &poremodel, index_t *idx, bool fwd_rev) {
+    // structured bindings can not be captured by the lambda below in C++17
+    int pore_k;
+    std::vector<double> pore_levels;
+    std::tie(pore_k, pore_levels) = load_pore_model(poremodel);
+    log_info("Beginning indexing of expected signals..");
+    fastx_reader_t reader(fasta_filename, 1);
+    fastx_batch_t batch;
+
+    auto add = [&](std::string &name, const auto &seq) {
+        auto squiggles = sequence2squiggles(seq, pore_k, pore_levels);
+        auto quant = quantize_signal_simple(squiggles);
+        idx->add_signal(name, parlay::make_slice(quant.begin(), quant.end()));
+    };
 
     u4 ref_id = 0;
-    while (ks >> record) {
-        auto squiggles = sequence2squiggles(record.seq, pore_k, pore_levels);
-        auto quant = quantize_signal_simple(squiggles);
-        // todo - add to index
-        sitrep("processed %u references.", ++ref_id);
+    while (reader.next(batch)) {
+        for (size_t i = 0; i < batch.size(); ++i) {
+            auto &seq = batch.seqs[i];
+            if (fwd_rev) {
+                auto s_name = batch.names[i] + "+";
+                add(s_name, seq);
+                s_name = batch.names[i] + "-";
+                add(s_name, revcmp(seq));
+            } else add(batch.names[i], seq);
+            sitrep("processed %u references.", ++ref_id);
+        }
     }
 
     stderrflush;
-    close(fd);
     idx->build();
 }
-
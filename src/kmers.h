@@ -0,0 +1,219 @@
+#ifndef COLLINEARITY_KMERS_H
+#define COLLINEARITY_KMERS_H
+
+#include <vector>
+#include "prelude.h"
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+/**
+ * 2-bit k-mer encoding of DNA, k <= 16 in 32-bit codes and k <= 32 in 64-bit ones.
+ * A base is encoded as (c >> 1) & 3, i.e. A=0, C=1, T=2, G=3, so that its complement is c ^ 2, and a k-mer is encoded
+ * with its first base in the most significant bits. This matches `encode_kmer` with `encode_dna` and sigma = 4.
+ *
+ * The sequence is first packed into 64-bit words of 32 bases each, first base in the most significant bits.
+ * The k-mer at any position is then a shift of two adjacent words, so all k-mers can be extracted independently of
+ * each other instead of through a serial rolling hash. The reverse complement of a k-mer is computed from the forward
+ * code by complementing and reversing its 2-bit groups.
+ */
+
+#define KMER_PACK_LEN 32
+
+enum kmer_isa_t { KMER_SCALAR, KMER_AVX2, KMER_AVX512 };
+
+static inline kmer_isa_t kmer_isa() {
+#if defined(__x86_64__)
+    static const kmer_isa_t isa = []() {
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw")) return KMER_AVX512;
+        if (__builtin_cpu_supports("avx2")) return KMER_AVX2;
+        return KMER_SCALAR;
+    }();
+    return isa;
+#else
+    return KMER_SCALAR;
+#endif
+}
+
+static inline u4 kmer_mask(int k) { return (k >= 16) ? ~0U : (1U << (2 * k)) - 1; }
+
+static inline u8 pack_bases_scalar(const char *s, size_t n) {
+    u8 w = 0;
+    for (size_t i = 0; i < n; ++i) w = (w << 2) | ((s[i] >> 1) & 3);
+    return w << (2 * (KMER_PACK_LEN - n));
+}
+
+static inline u4 revcmp_kmer(u4 x, int k) {
+    x ^= 0xAAAAAAAAU;
+    x = __builtin_bswap32(x);
+    x = ((x >> 4) & 0x0F0F0F0FU) | ((x & 0x0F0F0F0FU) << 4);
+    x = ((x >> 2) & 0x33333333U) | ((x & 0x33333333U) << 2);
+    return x >> (32 - 2 * k);
+}
+
+static inline u8 revcmp_kmer(u8 x, int k) {
+    x ^= 0xAAAAAAAAAAAAAAAAULL;
+    x = __builtin_bswap64(x);
+    x = ((x >> 4) & 0x0F0F0F0F0F0F0F0FULL) | ((x & 0x0F0F0F0F0F0F0F0FULL) << 4);
+    x = ((x >> 2) & 0x3333333333333333ULL) | ((x & 0x3333333333333333ULL) << 2);
+    return x >> (64 - 2 * k);
+}
+
+/**
+ * Pack `n` bases into ceil(n/32) + 1 words, the last one being zero
+ */
+static void pack_bases(const char *s, size_t n, u8 *packed) {
+    const size_t n_full = n / KMER_PACK_LEN;
+    for (size_t w = 0; w < n_full; ++w) packed[w] = pack_bases_scalar(s + w * KMER_PACK_LEN, KMER_PACK_LEN);
+    size_t w = n_full;
+    if (n % KMER_PACK_LEN) packed[w++] = pack_bases_scalar(s + n_full * KMER_PACK_LEN, n % KMER_PACK_LEN);
+    packed[w] = 0;
+}
+
+template <typename T>
+static void encode_kmers_scalar(const u8 *packed, size_t n_kmers, int k, T *fwd, T *rc) {
+    const int rshift = 64 - 2 * k;
+    for (size_t i = 0; i < n_kmers; ++i) {
+        const size_t w = i / KMER_PACK_LEN, j = i % KMER_PACK_LEN;
+        u8 x = j ? (packed[w] << (2 * j)) | (packed[w+1] >> (64 - 2 * j)) : packed[w];
+        fwd[i] = (T)(x >> rshift);
+    }
+    if (rc) for (size_t i = 0; i < n_kmers; ++i) rc[i] = revcmp_kmer(fwd[i], k);
+}
+
+#if defined(__x86_64__)
+
+__attribute__((target("avx2")))
+static void pack_bases_avx2(const char *s, size_t n, u8 *packed) {
+    const __m256i three = _mm256_set1_epi8(3);
+    const __m256i weights = _mm256_set1_epi32(0x01041040);     /// 64, 16, 4, 1 for the bytes of each dword
+    const __m256i ones = _mm256_set1_epi16(1);
+    const __m256i gather = _mm256_setr_epi8(0, 4, 8, 12, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+                                            0, 4, 8, 12, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1);
+    const size_t n_full = n / KMER_PACK_LEN;
+    for (size_t w = 0; w < n_full; ++w) {
+        __m256i c = _mm256_loadu_si256((const __m256i*)(s + w * KMER_PACK_LEN));
+        c = _mm256_and_si256(_mm256_srli_epi16(c, 1), three);
+        c = _mm256_madd_epi16(_mm256_maddubs_epi16(c, weights), ones);
+        c = _mm256_shuffle_epi8(c, gather);
+        u8 lo = (u4)_mm256_extract_epi32(c, 0), hi = (u4)_mm256_extract_epi32(c, 4);
+        packed[w] = __builtin_bswap64(lo | (hi << 32));
+    }
+    size_t w = n_full;
+    if (n % KMER_PACK_LEN) packed[w++] = pack_bases_scalar(s + n_full * KMER_PACK_LEN, n % KMER_PACK_LEN);
+    packed[w] = 0;
+}
+
+__attribute__((target("avx2")))
+static void encode_kmers_avx2(const u8 *packed, size_t n_kmers, int k, u4 *fwd, u4 *rc) {
+    const __m128i rshift = _mm_cvtsi32_si128(64 - 2 * k);
+    const __m256i step = _mm256_set1_epi64x(8), sixty_four = _mm256_set1_epi64x(64);
+    const __m256i compact = _mm256_setr_epi32(0, 2, 4, 6, 1, 3, 5, 7);
+    size_t i = 0;
+    for (size_t w = 0; i + KMER_PACK_LEN <= n_kmers; ++w, i += KMER_PACK_LEN) {
+        const __m256i hi = _mm256_set1_epi64x(packed[w]), lo = _mm256_set1_epi64x(packed[w+1]);
+        __m256i shift = _mm256_setr_epi64x(0, 2, 4, 6);
+        for (int g = 0; g < KMER_PACK_LEN / 4; ++g) {
+            /// a shift by 64 yields zero, which takes care of the k-mer that starts at the word boundary
+            __m256i x = _mm256_or_si256(_mm256_sllv_epi64(hi, shift), _mm256_srlv_epi64(lo, _mm256_sub_epi64(sixty_four, shift)));
+            x = _mm256_permutevar8x32_epi32(_mm256_srl_epi64(x, rshift), compact);
+            _mm_storeu_si128((__m128i*)(fwd + i + 4 * g), _mm256_castsi256_si128(x));
+            shift = _mm256_add_epi64(shift, step);
+        }
+    }
+    encode_kmers_scalar(packed + i / KMER_PACK_LEN, n_kmers - i, k, fwd + i, (u4*)nullptr);
+    if (!rc) return;
+
+    const __m256i comp = _mm256_set1_epi32(0xAAAAAAAA), m4 = _mm256_set1_epi32(0x0F0F0F0F), m2 = _mm256_set1_epi32(0x33333333);
+    const __m256i bswap = _mm256_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12,
+                                           3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12);
+    const __m128i rc_shift = _mm_cvtsi32_si128(32 - 2 * k);
+    for (i = 0; i + 8 <= n_kmers; i += 8) {
+        __m256i x = _mm256_xor_si256(_mm256_loadu_si256((const __m256i*)(fwd + i)), comp);
+        x = _mm256_shuffle_epi8(x, bswap);
+        x = _mm256_or_si256(_mm256_and_si256(_mm256_srli_epi32(x, 4), m4), _mm256_slli_epi32(_mm256_and_si256(x, m4), 4));
+        x = _mm256_or_si256(_mm256_and_si256(_mm256_srli_epi32(x, 2), m2), _mm256_slli_epi32(_mm256_and_si256(x, m2), 2));
+        _mm256_storeu_si256((__m256i*)(rc + i), _mm256_srl_epi32(x, rc_shift));
+    }
+    for (; i < n_kmers; ++i) rc[i] = revcmp_kmer(fwd[i], k);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static void encode_kmers_avx512(const u8 *packed, size_t n_kmers, int k, u4 *fwd, u4 *rc) {
+    const __m128i rshift = _mm_cvtsi32_si128(64 - 2 * k);
+    const __m512i step = _mm512_set1_epi64(16), sixty_four = _mm512_set1_epi64(64);
+    size_t i = 0;
+    for (size_t w = 0; i + KMER_PACK_LEN <= n_kmers; ++w, i += KMER_PACK_LEN) {
+        const __m512i hi = _mm512_set1_epi64(packed[w]), lo = _mm512_set1_epi64(packed[w+1]);
+        __m512i shift = _mm512_setr_epi64(0, 2, 4, 6, 8, 10, 12, 14);
+        for (int g = 0; g < KMER_PACK_LEN / 8; ++g) {
+            __m512i x = _mm512_or_si512(_mm512_sllv_epi64(hi, shift), _mm512_srlv_epi64(lo, _mm512_sub_epi64(sixty_four, shift)));
+            _mm256_storeu_si256((__m256i*)(fwd + i + 8 * g), _mm512_cvtepi64_epi32(_mm512_srl_epi64(x, rshift)));
+            shift = _mm512_add_epi64(shift, step);
+        }
+    }
+    encode_kmers_scalar(packed + i / KMER_PACK_LEN, n_kmers - i, k, fwd + i, (u4*)nullptr);
+    if (!rc) return;
+
+    const __m512i comp = _mm512_set1_epi32(0xAAAAAAAA), m4 = _mm512_set1_epi32(0x0F0F0F0F), m2 = _mm512_set1_epi32(0x33333333);
+    const __m512i bswap = _mm512_broadcast_i32x4(_mm_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12));
+    const __m128i rc_shift = _mm_cvtsi32_si128(32 - 2 * k);
+    for (i = 0; i + 16 <= n_kmers; i += 16) {
+        __m512i x = _mm512_xor_si512(_mm512_loadu_si512(fwd + i), comp);
+        x = _mm512_shuffle_epi8(x, bswap);
+        x = _mm512_or_si512(_mm512_and_si512(_mm512_srli_epi32(x, 4), m4), _mm512_slli_epi32(_mm512_and_si512(x, m4), 4));
+        x = _mm512_or_si512(_mm512_and_si512(_mm512_srli_epi32(x, 2), m2), _mm512_slli_epi32(_mm512_and_si512(x, m2), 2));
+        _mm512_storeu_si512(rc + i, _mm512_srl_epi32(x, rc_shift));
+    }
+    for (; i < n_kmers; ++i) rc[i] = revcmp_kmer(fwd[i], k);
+}
+
+#endif
+
+/**
+ * Encode all k-mers of a DNA sequence
+ * @param seq the sequence
+ * @param n length of the sequence, at least k
+ * @param k k-mer length, at most 16
+ * @param fwd n-k+1 codes of the forward k-mers are written here
+ * @param rc if not null, the code of the reverse complement of the i-th k-mer is written to rc[i]
+ */
+static void encode_dna_kmers(const char *seq, size_t n, int k, u4 *fwd, u4 *rc = nullptr) {
+    static thread_local std::vector<u8> packed;
+    const size_t n_kmers = n - k + 1;
+    packed.resize(n / KMER_PACK_LEN + 2);
+#if defined(__x86_64__)
+    switch (kmer_isa()) {
+        case KMER_AVX512:
+            pack_bases_avx2(seq, n, packed.data());
+            encode_kmers_avx512(packed.data(), n_kmers, k, fwd, rc);
+            return;
+        case KMER_AVX2:
+            pack_bases_avx2(seq, n, packed.data());
+            encode_kmers_avx2(packed.data(), n_kmers, k, fwd, rc);
+            return;
+        default: break;
+    }
+#endif
+    pack_bases(seq, n, packed.data());
+    encode_kmers_scalar(packed.data(), n_kmers, k, fwd, rc);
+}
+
+/**
+ * Like the above, but into 64-bit codes for k up to 32. The bases are still packed with SIMD, the k-mers are only
+ * extracted by the scalar kernel.
+ */
+static void encode_dna_kmers(const char *seq, size_t n, int k, u8 *fwd, u8 *rc = nullptr) {
+    static thread_local std::vector<u8> packed;
+    packed.resize(n / KMER_PACK_LEN + 2);
+#if defined(__x86_64__)
+    if (kmer_isa() != KMER_SCALAR) pack_bases_avx2(seq, n, packed.data());
+    else pack_bases(seq, n, packed.data());
+#else
+    pack_bases(seq, n, packed.data());
+#endif
+    encode_kmers_scalar(packed.data(), n - k + 1, k, fwd, rc);
+}
+
+#endif //COLLINEARITY_KMERS_H
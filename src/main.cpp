@@ -9,20 +9,32 @@ int main(int argc, char *argv[]) {
             if (config.compressed) idx = new cj_index_t(config);
             else idx = new j_index_t(config);
         }
+        else if (config.sigma == SIGNAL_SIGMA) idx = new s_index_t(config);
+        else if (config.compressed) idx = new cc_index_t(config);
         else idx = new c_index_t(config);
-        index_fasta(config.ref, idx);
+        if (config.sigma == SIGNAL_SIGMA) index_fasta_raw(config.ref, config.pore_model, idx, config.fwd_rev);
+        else index_fasta(config.ref, idx);
         dump_index(config.idx, config, idx);
     } else if (config.phase == config_t::query) {
-        idx = load_index(config.idx);
-        query_fasta(idx, config.qry, 4096, config.out);
+        idx = load_index(config.idx, config.verify_index);
+        if (config.mask_occ) idx->mask_occurrences(config.max_occ);
+        if (is_slow5_filename(config.qry)) query_blow5(idx, config.qry, config.batch_size, config.out, config.out_fmt);
+        else query_fasta(idx, config.qry, config.batch_size, config.out, config.out_fmt);
     } else if (config.phase == config_t::both) {
         if (config.jaccard) {
             if (config.compressed) idx = new cj_index_t(config);
             else idx = new j_index_t(config);
         }
+        else if (config.sigma == SIGNAL_SIGMA) idx = new s_index_t(config);
+        else if (config.compressed) idx = new cc_index_t(config);
         else idx = new c_index_t(config);
-        index_fasta(config.ref, idx);
-        query_fasta(idx, config.qry, 4096, config.out);
+        if (config.sigma == SIGNAL_SIGMA) index_fasta_raw(config.ref, config.pore_model, idx, config.fwd_rev);
+        else index_fasta(config.ref, idx);
+        if (config.mask_occ) idx->mask_occurrences(config.max_occ);
+        if (is_slow5_filename(config.qry)) query_blow5(idx, config.qry, config.batch_size, config.out, config.out_fmt);
+        else query_fasta(idx, config.qry, config.batch_size, config.out, config.out_fmt);
+    } else if (config.phase == config_t::inspect) {
+        inspect_index(config.idx, config.verify_index);
     }
 
     return 0;
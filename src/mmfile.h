@@ -0,0 +1,121 @@
+#ifndef COLLINEARITY_MMFILE_H
+#define COLLINEARITY_MMFILE_H
+
+#include <memory>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "prelude.h"
+
+/**
+ * A read-only memory mapping of a whole file.
+ * The pages are shared between all processes that map the same file.
+ */
+class mmap_file_t {
+    int fd = -1;
+    char *base = nullptr;
+    size_t _size = 0;
+public:
+    explicit mmap_file_t(const std::string &filename) {
+        fd = open(filename.c_str(), O_RDONLY);
+        if (fd < 0) throw std::runtime_error("could not open " + filename + ": " + strerror(errno));
+        struct stat st{};
+        if (fstat(fd, &st) < 0) throw std::runtime_error("could not stat " + filename + ": " + strerror(errno));
+        _size = st.st_size;
+        if (_size) {
+            void *p = mmap(nullptr, _size, PROT_READ, MAP_SHARED, fd, 0);
+            if (p == MAP_FAILED) throw std::runtime_error("could not map " + filename + ": " + strerror(errno));
+            base = (char*)p;
+        }
+    }
+    mmap_file_t(const mmap_file_t&) = delete;
+    mmap_file_t& operator = (const mmap_file_t&) = delete;
+    ~mmap_file_t() {
+        if (base) munmap(base, _size);
+        if (fd >= 0) close(fd);
+    }
+
+    inline const char* data() const { return base; }
+    inline size_t size() const { return _size; }
+
+    /**
+     * Hint the kernel about how a range of the file will be accessed
+     * @param offset start of the range (need not be page-aligned)
+     * @param length length of the range
+     * @param advice one of the MADV_* constants
+     */
+    void advise(size_t offset, size_t length, int advice) const {
+        if (!base || !length) return;
+        size_t start = offset & ~(PAGE_SZ - 1);
+        madvise(base + start, length + (offset - start), advice);
+    }
+};
+
+/**
+ * A cursor over a memory-mapped file which mirrors the std::istream based loaders in prelude.h.
+ * Scalars and small sequences are copied out, large arrays are returned as views into the mapping.
+ */
+class mmap_reader_t {
+    std::shared_ptr<mmap_file_t> file;
+    size_t pos = 0;
+public:
+    explicit mmap_reader_t(std::shared_ptr<mmap_file_t> file, size_t pos = 0) : file(std::move(file)), pos(pos) {}
+
+    inline size_t tell() const { return pos; }
+    inline void seek(size_t offset) { pos = offset; }
+    inline std::shared_ptr<mmap_file_t>& mapping() { return file; }
+
+    void read(void *dst, size_t n) {
+        if (pos + n > file->size()) throw std::runtime_error("unexpected end of file");
+        memcpy(dst, file->data() + pos, n);
+        pos += n;
+    }
+
+    void align(size_t alignment=PAGE_SZ) { pos = alignup(pos, alignment); }
+
+    /**
+     * Get a view of the next `n` elements in the file and move past them
+     * @tparam T element type
+     * @param n number of elements
+     * @return a pointer into the mapping which stays valid while the mapping is alive
+     */
+    template <typename T>
+    const T* view(size_t n) {
+        if (pos + n * sizeof(T) > file->size()) throw std::runtime_error("unexpected end of file");
+        auto p = reinterpret_cast<const T*>(file->data() + pos);
+        pos += n * sizeof(T);
+        return p;
+    }
+};
+
+template <class T>
+static void load_values(mmap_reader_t &f, T *p_var) {
+    f.read(p_var, sizeof(*p_var));
+}
+
+template <class T, typename... Args>
+static void load_values(mmap_reader_t &f, T *p_var, Args... args) {
+    f.read(p_var, sizeof(*p_var));
+    load_values(f, args...);
+}
+
+template <class Seq>
+static inline void load_seq(mmap_reader_t &f, Seq &seq) {
+    size_t n = 0;
+    load_values(f, &n);
+    seq.resize(n);
+    f.read(seq.data(), n * sizeof(seq[0]));
+}
+
+/**
+ * Map a sequence written by `dump_aligned_seq`
+ * @return a pointer to the first element of the sequence and its length
+ */
+template <typename T>
+static inline std::pair<const T*, size_t> map_aligned_seq(mmap_reader_t &f) {
+    size_t n = 0;
+    load_values(f, &n);
+    f.align();
+    return {f.view<T>(n), n};
+}
+
+#endif //COLLINEARITY_MMFILE_H
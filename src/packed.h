@@ -0,0 +1,107 @@
+#ifndef COLLINEARITY_PACKED_H
+#define COLLINEARITY_PACKED_H
+
+#include "prelude.h"
+#include "parlay_utils.h"
+#include "mmfile.h"
+
+/**
+ * An array of unsigned integers of a fixed bit width, packed into 64-bit words.
+ * An element may straddle two words. Every 64 elements take exactly `width` words, so blocks of 64 elements are
+ * packed in parallel, and a padding word at the end lets a read always load two words.
+ * It is dumped as one aligned sequence of words and can be memory-mapped.
+ */
+class packed_array_t {
+    parlay::sequence<u8> words;     /// owned storage, empty if the array is mapped
+    const u8 *data = nullptr;
+    size_t n = 0;
+    u4 width = 0;
+    u8 mask = 0;
+
+    void set_width(u4 w) {
+        width = w;
+        mask = width == 64 ? ~0ULL : (1ULL << width) - 1;
+    }
+
+public:
+    packed_array_t() = default;
+    packed_array_t(const packed_array_t&) = delete;
+    packed_array_t& operator = (const packed_array_t&) = delete;
+    packed_array_t(packed_array_t &&other) = default;
+    packed_array_t& operator = (packed_array_t &&other) = default;
+
+    /**
+     * Pack n elements
+     * @param width bits per element, between 1 and 64
+     * @param get returns the i-th element, which must fit in width bits
+     */
+    template <typename F>
+    packed_array_t(size_t n, u4 width, F get) : n(n) {
+        set_width(width);
+        const size_t n_blocks = (n + 63) / 64;
+        words = parlay::sequence<u8>(n_blocks * width + 1, 0);
+        parlay::parallel_for(0, n_blocks, [&](size_t b) {
+            u8 *w = words.data() + b * width;
+            u4 off = 0;
+            for (size_t i = b * 64; i < std::min(n, (b + 1) * 64); ++i) {
+                const u8 v = get(i);
+                *w |= v << off;
+                if (off + width >= 64) {
+                    if (off + width > 64) w[1] |= v >> (64 - off);
+                    ++w;
+                }
+                off = (off + width) & 63;
+            }
+        });
+        data = words.data();
+    }
+
+    inline size_t size() const { return n; }
+    inline bool empty() const { return n == 0; }
+    inline u4 bits() const { return width; }
+    inline size_t size_in_bytes() const { return (n * width + 63) / 64 * 8 + 8; }
+
+    inline u8 operator[](const size_t i) const {
+        const size_t bit = i * width, w = bit >> 6;
+        const u4 off = bit & 63;
+        /// the high part is shifted in two steps because shifting a 64-bit word by 64 is undefined
+        return ((data[w] >> off) | ((data[w+1] << 1) << (63 - off))) & mask;
+    }
+
+    /**
+     * @return a pointer to the word that holds the start of the i-th element, for prefetching
+     */
+    inline const u8* data_at(const size_t i) const { return data + ((i * width) >> 6); }
+
+    /**
+     * Visit the elements in [begin, end) in order, advancing a bit cursor instead of computing each address
+     */
+    template <typename F>
+    inline void for_each(const size_t begin, const size_t end, F f) const {
+        size_t bit = begin * width;
+        for (size_t i = begin; i < end; ++i, bit += width) {
+            const u8 *w = data + (bit >> 6);
+            const u4 off = bit & 63;
+            f(((w[0] >> off) | ((w[1] << 1) << (63 - off))) & mask);
+        }
+    }
+
+    void dump(std::ostream &fs) {
+        dump_values(fs, n, width);
+        dump_aligned_seq(fs, words);
+    }
+
+    /**
+     * Make this array a read-only view of an array dumped into a memory-mapped file, which must outlive it
+     * @param fs reader positioned where `dump` started writing
+     */
+    void load(mmap_reader_t &fs) {
+        u4 w;
+        load_values(fs, &n, &w);
+        set_width(w);
+        words.clear();
+        data = map_aligned_seq<u8>(fs).first;
+    }
+};
+
+#endif //COLLINEARITY_PACKED_H
@@ -11,6 +11,7 @@
 #include "parlay/sequence.h"
 #include "parlay/slice.h"
 #include "parlay/io.h"
+#include <mutex>
 
 /**
  * Fill an array with value
@@ -100,4 +101,14 @@ static inline void sort_by_key(T1* a, T2 *b, T3 *c, size_t n) {
     p_scatter(c, n, index.data(), c);
 }
 
+/**
+ * Parlay gives every thread outside its pool the same worker id, so two such threads, like a background merge and a
+ * Python thread, must not run parallel code at the same time. They hold this lock around their parallel sections.
+ * It is not static, so that all translation units share it.
+ */
+inline std::mutex& external_parlay_mutex() {
+    static std::mutex mtx;
+    return mtx;
+}
+
 #endif //COLLINEARITY_PARLAY_UTILS_H
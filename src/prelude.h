@@ -88,6 +88,15 @@ typedef uint16_t u2;
 typedef uint32_t u4;
 typedef uint64_t u8;
 
+/// codes of k-mers, 64 bits wide when built with -DWIDE_KMERS=ON, which allows larger k at twice the memory per key
+#ifdef WIDE_KMERS
+typedef u8 kmer_t;
+#define MAX_K 21
+#else
+typedef u4 kmer_t;
+#define MAX_K 16
+#endif
+
 /** memory allocation/deallcoation utils */
 #define KiB <<10u
 #define MiB <<20u
@@ -154,4 +163,36 @@ static inline void load_data(std::ifstream &fs, T *data, size_t n) {
     fs.read(reinterpret_cast<char*>(data), n * sizeof(T));
 }
 
+/** large arrays in an index file start at a page boundary so that they can be memory-mapped in place */
+#define PAGE_SZ 4096UL
+
+static inline void dump_padding(std::ostream &f, size_t alignment=PAGE_SZ) {
+    static const char zeros[PAGE_SZ] = {0};
+    size_t pos = f.tellp();
+    size_t pad = alignup(pos, alignment) - pos;
+    f.write(zeros, pad);
+}
+
+static inline void load_padding(std::istream &f, size_t alignment=PAGE_SZ) {
+    size_t pos = f.tellg();
+    f.seekg(alignup(pos, alignment));
+}
+
+template <class Seq>
+static inline void dump_aligned_seq(std::ostream &f, Seq &seq) {
+    size_t n = seq.size();
+    dump_values(f, n);
+    dump_padding(f);
+    f.write(reinterpret_cast<const char*>(seq.data()), n * sizeof(seq[0]));
+}
+
+template <class Seq>
+static inline void load_aligned_seq(std::istream &f, Seq &seq) {
+    size_t n = 0;
+    load_values(f, &n);
+    load_padding(f);
+    seq.resize(n);
+    f.read(reinterpret_cast<char*>(seq.data()), n * sizeof(seq[0]));
+}
+
 #endif //COLLINEARITY_PRELUDE_H
@@ -9,6 +9,7 @@
 #include "argparse/argparse.hpp"
 
 namespace py = pybind11;
+using namespace std;
 
 static inline char* to_c_str(std::string &s) {
     auto cs = new char[s.size()+1];
@@ -44,15 +45,37 @@ static vector<char*> kwargs_to_argv(const py::args& args, const py::kwargs& kwar
     return argv;
 }
 
+/**
+ * The contig shares ownership of the index whose header it points to, so an alignment neither copies the name nor
+ * outlives it
+ */
 struct Alignment {
-    string ctg;
+    shared_ptr<const char> ctg = shared_ptr<const char>(shared_ptr<void>(), "*");
     int r_st = 0, r_en = 0, strand = 1;
     float pres_frac = 0.0f;
 
     Alignment() = default;
 
+    Alignment(shared_ptr<const char> ctg, bool fwd, int start, float pres_frac, int qry_len):
+        ctg(std::move(ctg)), r_st(start), r_en(start + qry_len), strand(fwd?1:-1), pres_frac(pres_frac) {}
+
+    /// the header is copied, since it may point into a temporary buffer of the caller
     Alignment(const char *header, bool fwd, int start, float pres_frac, int qry_len):
-        ctg(header), r_st(start), r_en(start + qry_len), strand(fwd?1:-1), pres_frac(pres_frac) {}
+        Alignment(own(header), fwd, start, pres_frac, qry_len) {}
+
+    /**
+     * @return a header that is kept alive by `owner`; literals such as "*" are not owned by anything
+     */
+    template <typename T>
+    static shared_ptr<const char> share(const shared_ptr<T> &owner, const char *header) {
+        return shared_ptr<const char>(owner, header);
+    }
+
+private:
+    static shared_ptr<const char> own(const char *header) {
+        auto name = make_shared<const string>(header);
+        return shared_ptr<const char>(name, name->c_str());
+    }
 };
 
 struct Request {
@@ -92,86 +115,104 @@ struct Index {
     explicit Index(string &input, const py::args& args, const py::kwargs& kwargs):
     config(kwargs_to_argv(args, kwargs))
     {
+        std::lock_guard<std::mutex> lock(external_parlay_mutex());
         if (str_endswith(input.c_str(), ".cidx")) {
-            idx = load_index(input);
+            idx.reset(load_index(input));
         } else {
             if (config.jaccard) {
                 if (config.compressed) {
                     log_info("Creating compressed Jaccard index");
-                    idx = new cj_index_t(config);
+                    idx = make_shared<cj_index_t>(config);
                 } else {
                     log_info("Creating Jaccard index");
-                    idx = new j_index_t(config);
+                    idx = make_shared<j_index_t>(config);
                 }
             }
+            else if (config.compressed) {
+                log_info("Creating compressed coordinate index");
+                idx = make_shared<cc_index_t>(config);
+            }
             else {
                 log_info("Creating coordinate index");
-                idx = new c_index_t(config);
+                idx = make_shared<c_index_t>(config);
             }
             if (config.fwd_rev) log_info("Indexing both fwd and rev references");
             else log_info("Indexing fwd references only");
 
-            if (str_endswith(input.c_str(), ".fa") || str_endswith(input.c_str(), ".fasta")) {
+            if (is_fastx_filename(input)) {
                 log_info("Building index from %s", input.c_str());
-                index_fasta(input, idx);
-            } else if (str_endswith(input.c_str(), ".fa.gz") || str_endswith(input.c_str(), ".fasta.gz")) {
-                // gzipped reference. will support it later - todo
-                log_error("This is not implemented yet");
+                index_fasta(input, idx.get());
             } else {
                 log_error("Unknown input file format for file %s", input.c_str());
             }
         }
+        if (config.mask_occ) idx->mask_occurrences(config.max_occ);
         idx->init_query_buffers();
     }
 
     void dump(const string &basename) {
         string filename = basename + ".cidx";
         log_info("Dumping index to %s", filename.c_str());
-        dump_index(filename, config, idx);
+        std::lock_guard<std::mutex> lock(external_parlay_mutex());
+        dump_index(filename, config, idx.get());
         log_info("Done.");
     }
 
     void load(const string &basename) {
         string filename = basename + ".cidx";
         log_info("Loading index from %s", filename.c_str());
-        idx = load_index(filename);
+        std::lock_guard<std::mutex> lock(external_parlay_mutex());
+        idx.reset(load_index(filename));      /// alignments of the previous index keep it alive
+        if (config.mask_occ) idx->mask_occurrences(config.max_occ);
         log_info("Done.");
     }
 
-    Alignment query(string &sequence) {
+    Alignment query(string_view sequence) {
         auto result = idx->search(sequence);
         return {
-            get<0>(result), get<1>(result),
+            Alignment::share(idx, get<0>(result)), get<1>(result),
                     static_cast<int>(get<2>(result)), get<3>(result), static_cast<int>(sequence.size())};
     }
 
     vector<Alignment> query_batch(const py::list& sequences) {
         auto nr = sequences.size();
+        // views of the buffers of the python strings, taken while holding the GIL
+        vector<string_view> views(nr);
+        for (size_t i = 0; i < nr; ++i) views[i] = sequences[i].cast<string_view>();
         vector<Alignment> results(nr);
+        // a background merge may be running parallel code outside the pool too, so wait for it without the GIL
+        py::gil_scoped_release release;
+        std::lock_guard<std::mutex> lock(external_parlay_mutex());
         parlay::for_each(parlay::iota(nr), [&](size_t i){
-            auto sequence = sequences[i].cast<string>();
-            results[i] = query(sequence);
+            results[i] = query(views[i]);
         });
         return results;
     }
 
     ResponseGenerator query_stream(const py::iterator& reads) {
         if (!stream_ready) log_error("Query stream is not ready.");
-        parlay::sequence<Request> requests;
+        // the requests are referenced instead of copied, and kept alive by holding on to their python objects
+        vector<py::object> held;
+        parlay::sequence<Request*> requests;
         for (auto &read: reads) {
-            auto request = read.cast<Request>();
-            requests.push_back(request);
+            held.push_back(py::reinterpret_borrow<py::object>(read));
+            requests.push_back(&read.cast<Request&>());
+        }
+        parlay::sequence<Response> responses;
+        {
+            py::gil_scoped_release release;
+            std::lock_guard<std::mutex> lock(external_parlay_mutex());
+            responses = parlay::tabulate(requests.size(), [&](size_t i) {
+                auto alignment = query(requests[i]->seq);
+                return Response(requests[i]->channel, requests[i]->id, alignment);
+            });
         }
-        auto responses = parlay::tabulate(requests.size(), [&](size_t i) {
-            auto alignment = query(requests[i].seq);
-            return Response(requests[i].channel, requests[i].id, alignment);
-        });
         return ResponseGenerator(responses);
     }
 
 protected:
     config_t config;
-    index_t *idx = nullptr;
+    shared_ptr<index_t> idx;
     vector<string> argvec;
     bool stream_ready = false;
 };
@@ -180,7 +221,7 @@ struct DynIndex {
     DynIndex(const py::args& args, const py::kwargs& kwargs) {
         auto argv = kwargs_to_argv(args, kwargs);
         config_t config(argv);
-        idx = new dindex_t(config);
+        idx = make_shared<dindex_t>(config);
     }
 
     void add(string &name, string &seq) {
@@ -198,25 +239,34 @@ struct DynIndex {
 
     void merge() { idx->merge(); }
 
-    Alignment query(string &sequence) {
+    void merge_async() { idx->merge_async(); }
+
+    void wait_merge() { idx->wait_merge(); }
+
+    Alignment query(string_view sequence) {
         auto result = idx->search(sequence);
         return {
-                get<0>(result), get<1>(result),
+                Alignment::share(idx, get<0>(result)), get<1>(result),
                 static_cast<int>(get<2>(result)), get<3>(result), static_cast<int>(sequence.size())};
     }
 
     vector<Alignment> query_batch(const py::list& sequences) {
         auto nr = sequences.size();
+        // views of the buffers of the python strings, taken while holding the GIL
+        vector<string_view> views(nr);
+        for (size_t i = 0; i < nr; ++i) views[i] = sequences[i].cast<string_view>();
         vector<Alignment> results(nr);
+        // a background merge may be running parallel code outside the pool too, so wait for it without the GIL
+        py::gil_scoped_release release;
+        std::lock_guard<std::mutex> lock(external_parlay_mutex());
         parlay::for_each(parlay::iota(nr), [&](size_t i){
-            auto sequence = sequences[i].cast<string>();
-            results[i] = query(sequence);
+            results[i] = query(views[i]);
         });
         return results;
     }
 
 private:
-    dindex_t *idx = nullptr;
+    shared_ptr<dindex_t> idx;       /// headers are never dropped from a dynamic index, so alignments can share it
 };
 
 // Binding the function to the Python module
@@ -226,7 +276,7 @@ PYBIND11_MODULE(_core, m) {
             .def(py::init<const char*, bool, int, float, int>(),  // Parameterized constructor
                  py::arg("header"), py::arg("fwd"), py::arg("start"),
                  py::arg("pres_frac"), py::arg("qry_len"))
-            .def_readonly("ctg", &Alignment::ctg)
+            .def_property_readonly("ctg", [](const Alignment &a) { return a.ctg.get(); })
             .def_readonly("r_st", &Alignment::r_st)
             .def_readonly("r_en", &Alignment::r_en)
             .def_readonly("strand", &Alignment::strand)
@@ -244,8 +294,10 @@ PYBIND11_MODULE(_core, m) {
             .def(py::init<const py::args&, const py::kwargs&>())
             .def("add", &DynIndex::add)
             .def("add_batch", &DynIndex::add_batch)
-            .def("merge", &DynIndex::merge)
-            .def("query", &DynIndex::query)
+            .def("merge", &DynIndex::merge, py::call_guard<py::gil_scoped_release>())
+            .def("merge_async", &DynIndex::merge_async)
+            .def("wait_merge", &DynIndex::wait_merge, py::call_guard<py::gil_scoped_release>())
+            .def("query", &DynIndex::query, py::call_guard<py::gil_scoped_release>())
             .def("query_batch", &DynIndex::query_batch);
 
     py::class_<Request>(m, "Request")
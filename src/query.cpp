@@ -3,7 +3,8 @@
 //
 
 #include "collinearity.h"
-#include "../external/slow5lib/include/slow5/slow5.h"
+#include "blow5.h"
+#include <sstream>
 
 #define SANITY_CHECKS 1
 
@@ -22,61 +23,215 @@ std::vector<std::tuple<std::string, bool, u4, float>> query_batch(index_t *idx,
     return results;
 }
 
-void query_fasta(index_t *idx, std::string &fasta_filename, int batch_sz, std::string &outfile) {
-    auto fp = fopen(outfile.c_str(), "w");
-    if (!fp) log_error("Could not open %s because %s.", outfile.c_str(), strerror(errno));
+typedef std::tuple<const char*, bool, u4, float> result_t;
 
+/**
+ * Binary output is a header followed by one fixed-size record per query, in the order of the queries.
+ * The header is the magic string, the number of references, and the name and length of each reference.
+ */
+#define RESULTS_MAGIC "CLRES01"
+
+struct __attribute__((packed)) result_record_t {
+    u4 ref_id;                  /// -1 if the query was not mapped
+    u4 ref_pos;
+    u4 qry_len;
+    float presence;
+    u1 fwd;
+};
+
+struct ref_info_t {
+    u4 id;
+    u8 length;
+};
+
+/**
+ * Formats search results as text or binary records
+ */
+class result_formatter_t {
+    const config_t::out_fmt_t out_fmt;
+    emhash8::HashMap<const char*, ref_info_t> refs;     /// keyed by the header pointers that search returns
+
+public:
+    result_formatter_t(index_t *idx, config_t::out_fmt_t out_fmt) : out_fmt(out_fmt) {
+        auto &names = idx->reference_names();
+        auto &lengths = idx->reference_lengths();
+        if (out_fmt == config_t::paf && lengths.empty())
+            log_warn("The index has no reference lengths, so they are written as 0.");
+        for (u4 i = 0; i < names.size(); ++i)
+            refs[names[i].c_str()] = {i, i < lengths.size() ? lengths[i] : 0};
+    }
+
+    std::string header(index_t *idx) const {
+        if (out_fmt != config_t::bin) return "";
+        std::ostringstream ss;
+        ss.write(RESULTS_MAGIC, sizeof(RESULTS_MAGIC));
+        auto &names = idx->reference_names();
+        auto &lengths = idx->reference_lengths();
+        size_t n = names.size();
+        dump_values(ss, n);
+        for (size_t i = 0; i < n; ++i) {
+            u8 length = i < lengths.size() ? lengths[i] : 0;
+            dump_seq(ss, names[i]);
+            dump_values(ss, length);
+        }
+        return ss.str();
+    }
+
+    void format(std::string &out, const std::string &name, size_t qry_len, const result_t &result) const {
+        const auto &[ref_name, fwd, pos, presence] = result;
+        const auto it = refs.find(ref_name);
+        const bool mapped = it != refs.end();
+        char buf[160];
+        int n = 0;
+        switch (out_fmt) {
+            case config_t::tsv:
+                out += name;
+                n = snprintf(buf, sizeof(buf), "\t%zu\t", qry_len);
+                out.append(buf, n);
+                out += ref_name;
+                n = snprintf(buf, sizeof(buf), "\t%c\t%d\t%f\n", STRAND[(int)fwd], pos, presence);
+                out.append(buf, n);
+                break;
+            case config_t::paf:
+                out += name;
+                if (!mapped) {
+                    n = snprintf(buf, sizeof(buf), "\t%zu\t0\t0\t*\t*\t0\t0\t0\t0\t0\t0\n", qry_len);
+                    out.append(buf, n);
+                } else {
+                    const u8 ref_len = it->second.length;
+                    const u8 ref_end = ref_len ? std::min((u8)pos + qry_len, ref_len) : (u8)pos + qry_len;
+                    n = snprintf(buf, sizeof(buf), "\t%zu\t0\t%zu\t%c\t", qry_len, qry_len, STRAND[(int)fwd]);
+                    out.append(buf, n);
+                    out += ref_name;
+                    n = snprintf(buf, sizeof(buf), "\t%lu\t%u\t%lu\t%lu\t%lu\t255\tpf:f:%.4f\n", ref_len, pos, ref_end,
+                                 (u8)(presence * qry_len + 0.5), ref_end - pos, presence);
+                    out.append(buf, n);
+                }
+                break;
+            case config_t::bin: {
+                result_record_t record = {mapped ? it->second.id : (u4)-1, pos, (u4)qry_len, presence, (u1)fwd};
+                out.append(reinterpret_cast<const char*>(&record), sizeof(record));
+                break;
+            }
+        }
+    }
+};
+
+/**
+ * The last stage of a query pipeline: writes formatted batches of results in a background thread with one large
+ * write per batch
+ */
+class result_writer_t {
+    const std::string outfile;
+    FILE *fp;
+    bounded_queue_t<parlay::sequence<std::string>> formatted;
+    std::thread writer;
+
+public:
+    result_writer_t(const std::string &outfile, const std::string &header) : outfile(outfile), formatted(2) {
+        fp = fopen(outfile.c_str(), "w");
+        if (!fp) log_error("Could not open %s because %s.", outfile.c_str(), strerror(errno));
+        fwrite(header.data(), 1, header.size(), fp);
+        writer = std::thread([this]() {
+            parlay::sequence<std::string> blocks;
+            std::string out;
+            while (formatted.pop(blocks)) {
+                out.clear();
+                for (auto &block : blocks) out += block;
+                if (fwrite(out.data(), 1, out.size(), fp) != out.size())
+                    log_error("Could not write to %s because %s.", this->outfile.c_str(), strerror(errno));
+            }
+        });
+    }
+
+    /**
+     * Format the results of a batch in parallel, each block of results into its own buffer, and queue them for writing
+     * @param name name of the i-th query
+     * @param qry_len length of the i-th query
+     */
+    template <typename Name, typename Length>
+    void push(const result_formatter_t &formatter, const parlay::sequence<result_t> &results, Name name, Length qry_len) {
+        const size_t nr = results.size();
+        const size_t n_blocks = std::min(nr, (size_t)parlay::num_workers() * 4);
+        auto blocks = parlay::tabulate(n_blocks, [&](size_t b) {
+            std::string out;
+            for (size_t i = b * nr / n_blocks; i < (b + 1) * nr / n_blocks; ++i)
+                formatter.format(out, name(i), qry_len(i), results[i]);
+            return out;
+        });
+        formatted.push(std::move(blocks));
+    }
+
+    void finish() {
+        formatted.close();
+        writer.join();
+        fclose(fp);
+    }
+};
+
+void query_fasta(index_t *idx, std::string &fasta_filename, int batch_sz, std::string &outfile,
+                 config_t::out_fmt_t out_fmt) {
     idx->init_query_buffers();
-    std::vector<std::string> headers, sequences;
-    headers.reserve(batch_sz);
-    sequences.reserve(batch_sz);
-
-    // read sequences and convert to key-value pairs
-    KSeq record;
-    auto fd = open(fasta_filename.c_str(), O_RDONLY);
-    if (fd < 0) log_error("Could not open %s because %s.", fasta_filename.c_str(), strerror(errno));
-    auto ks = make_kstream(fd, read, mode::in);
+    const result_formatter_t formatter(idx, out_fmt);
+
+    // three stages: records are parsed in the background, searched and formatted here, and written in the background
+    fastx_reader_t reader(fasta_filename, batch_sz);
+    result_writer_t writer(outfile, formatter.header(idx));
+
+    fastx_batch_t batch;
     log_info("Begin query..");
-    int nr = 0;
     u8 total_nr = 0;
-    while (ks >> record) {
-        headers.emplace_back(record.name);
-        sequences.emplace_back(record.seq);
-        nr++;
-        if (nr == batch_sz) {
-            auto results = parlay::tabulate(nr, [&](size_t i) {
-                return idx->search(sequences[i]);
-            });
-            for (u4 i = 0; i < nr; ++i)
-                fprintf(fp, "%s\t%zu\t%s\t%c\t%d\t%f\n", headers[i].c_str(), sequences[i].length(), std::get<0>(results[i]),
-                       STRAND[(int)std::get<1>(results[i])], std::get<2>(results[i]), std::get<3>(results[i]));
-            total_nr += nr;
-            sitrep("%lu", total_nr);
-            nr = 0;
-            headers.clear();
-            sequences.clear();
-        }
-    }
-    if (nr) {
+    while (reader.next(batch)) {
+        const size_t nr = batch.size();
         auto results = parlay::tabulate(nr, [&](size_t i) {
-            return idx->search(sequences[i]);
+            return (result_t)idx->search(batch.seqs[i]);
         });
-        for (u4 i = 0; i < nr; ++i)
-            fprintf(fp, "%s\t%zu\t%s\t%c\t%d\t%f\n", headers[i].c_str(), sequences[i].length(), std::get<0>(results[i]),
-                   STRAND[(int)std::get<1>(results[i])], std::get<2>(results[i]), std::get<3>(results[i]));
+        writer.push(formatter, results, [&](size_t i) -> const std::string& { return batch.names[i]; },
+                    [&](size_t i) { return batch.seqs[i].length(); });
         total_nr += nr;
         sitrep("%lu", total_nr);
-        nr = 0;
-        headers.clear();
-        sequences.clear();
     }
+    writer.finish();
     stderrflush;
-    close(fd);
-    fclose(fp);
     log_info("Done.");
 }
 
-void query_blow5(index_t *idx, const char* blow5_filename, int batch_sz) {
-    throw "Not implemented";
-}
+void query_blow5(index_t *idx, std::string &blow5_filename, int batch_sz, std::string &outfile,
+                 config_t::out_fmt_t out_fmt) {
+    idx->init_query_buffers();
+    const result_formatter_t formatter(idx, out_fmt);
 
+    // records are decoded in the background, converted to pA, segmented, quantized, searched and formatted here,
+    // and written in the background
+    blow5_reader_t reader(blow5_filename, batch_sz, parlay::num_workers());
+    result_writer_t writer(outfile, formatter.header(idx));
+    // the segmenters keep per-read state, so each worker has its own
+    std::vector<tstat_segmenter_t> segmenters(parlay::num_workers());
+
+    blow5_batch_t batch;
+    log_info("Begin raw signal query..");
+    u8 total_nr = 0;
+    while (reader.next(batch)) {
+        const size_t nr = batch.size();
+        parlay::sequence<size_t> n_events(nr);
+        auto results = parlay::tabulate(nr, [&](size_t i) {
+            const auto &raw = batch.signals[i];
+            const auto &[digitisation, offset, range] = batch.scales[i];
+            auto signal = parlay::tabulate(raw.size(), [&](size_t j) {
+                return TO_PICOAMPS((double)raw[j], digitisation, offset, range);
+            }, raw.size());
+            auto events = generate_events(signal, segmenters[parlay::worker_id()]);
+            auto qsig = quantize_signal_simple(events);
+            n_events[i] = qsig.size();
+            const auto [header, pos, presence] = idx->search_signal(parlay::make_slice(qsig.begin(), qsig.end()));
+            return std::make_tuple(header, true, pos, presence);
+        }, 1);
+        writer.push(formatter, results, [&](size_t i) -> const std::string& { return batch.names[i]; },
+                    [&](size_t i) { return n_events[i]; });
+        total_nr += nr;
+        sitrep("%lu", total_nr);
+    }
+    writer.finish();
+    stderrflush;
+    log_info("Done.");
+}
@@ -9,6 +9,7 @@
 
 #include "prelude.h"
 #include "vector"
+#include <array>
 
 std::pair<int, std::vector<double>> load_pore_model(std::string &poremodel_file);
 
@@ -37,7 +38,6 @@ struct ri_detect_t {
     const float THRESHOLD;
     const uint32_t WINDOW_LENGTH;
 
-    parlay::sequence<double> tstat;
     uint32_t masked_to = 0;
     int peak_pos = -1;
     double peak_value = __FLT_MAX__;
@@ -46,8 +46,17 @@ struct ri_detect_t {
     void reset() { masked_to = 0, peak_pos = DEF_PEAK_POS, peak_value = DEF_PEAK_VAL, valid_peak = 0; }
 };
 
+#define SEG_RING_SIZE 64
+#define SEG_RING_MASK (SEG_RING_SIZE - 1)
+
+/**
+ * Detects event boundaries as peaks of t-statistics over two window lengths.
+ * The t-statistics are computed from running prefix sums in a single pass that also detects the peaks, so besides
+ * the peaks nothing is allocated per signal. A segmenter keeps state while segmenting, so each thread needs its own.
+ */
 class tstat_segmenter_t : public signal_segmenter_i {
     std::vector<ri_detect_t> detectors;
+    std::array<double, SEG_RING_SIZE> prefix_sum, prefix_sum_sq;
 public:
     tstat_segmenter_t() {
         detectors.emplace_back(3, 4.0);
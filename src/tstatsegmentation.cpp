@@ -7,54 +7,21 @@
 using namespace std;
 //using namespace parlay;
 
-static pair<parlay::sequence<double>, parlay::sequence<double>> compute_prefix_prefixsq(const parlay::sequence<double> &signal) {
-    const auto s_len = signal.size();
-    parlay::sequence<double> prefix_sum(s_len+1, 0), prefix_sum_square(s_len+1, 0);
-    inclusive_scan(signal.begin(), signal.end(), prefix_sum.begin()+1);
-    transform_inclusive_scan(signal.begin(), signal.end(), prefix_sum_square.begin()+1, plus<>(),
-                             [](double x) { return x * x; });
-    return {prefix_sum, prefix_sum_square};
-}
-
-static parlay::sequence<double> compute_tstat(parlay::sequence<double> &prefix_sum, parlay::sequence<double> &prefix_sum_square, int w) {
-    // Compute windowed tstat
-    const auto s_len = prefix_sum.size() - 1;  // length of original signal
-    double eta = numeric_limits<double>::epsilon();  // Equivalent of FLT_MIN
-    parlay::sequence<double> tstat(s_len + 1, 0.0);
-
-    // Check for conditions
-    if (s_len < 2 * w || w < 2) {
-        return tstat;
-    }
-
-    for (int i = w; i <= s_len - w; ++i) {
-        double sum1 = prefix_sum[i];
-        double sumsq1 = prefix_sum_square[i];
-        if (i > w) {
-            sum1 -= prefix_sum[i - w];
-            sumsq1 -= prefix_sum_square[i - w];
-        }
-
-        double sum2 = prefix_sum[i + w] - prefix_sum[i];
-        double sumsq2 = prefix_sum_square[i + w] - prefix_sum_square[i];
-
-        double mean1 = sum1 / w;
-        double mean2 = sum2 / w;
-
-        double combined_var = (sumsq1 / w - mean1 * mean1 + sumsq2 / w - mean2 * mean2) / w;
-
-        // Ensure combined_var is not too small
-        combined_var = max(combined_var, eta);
-
-        // Compute t-statistic
-        double delta_mean = mean2 - mean1;
-        tstat[i] = abs(delta_mean) / sqrt(combined_var);
-    }
-
-    // Set last `w_len` elements to 0 (fudging boundaries)
-    fill(tstat.begin() + s_len - w + 1, tstat.end(), 0.0f);
-
-    return tstat;
+/**
+ * The t-statistic of the difference between the means of the w samples before and the w samples from position i.
+ * Positions closer than w to either end of the signal have a t-statistic of 0.
+ * @param ps ring of prefix sums, the sum of the first j samples being at ps[j & SEG_RING_MASK]
+ * @param pss ring of prefix sums of squares
+ */
+static inline double tstat_at(const double *ps, const double *pss, const size_t i, const size_t s_len, const u4 w) {
+    constexpr double eta = numeric_limits<double>::epsilon();
+    if (s_len < 2 * w || w < 2 || i < w || i + w > s_len) return 0;
+    const size_t lo = (i - w) & SEG_RING_MASK, mid = i & SEG_RING_MASK, hi = (i + w) & SEG_RING_MASK;
+    const double sum1 = ps[mid] - ps[lo], sumsq1 = pss[mid] - pss[lo];
+    const double sum2 = ps[hi] - ps[mid], sumsq2 = pss[hi] - pss[mid];
+    const double mean1 = sum1 / w, mean2 = sum2 / w;
+    const double combined_var = max((sumsq1 / w - mean1 * mean1 + sumsq2 / w - mean2 * mean2) / w, eta);
+    return abs(mean2 - mean1) / sqrt(combined_var);
 }
 
 parlay::sequence<size_t> tstat_segmenter_t::segment_signal(const parlay::sequence<double> &signal) {
@@ -62,18 +29,30 @@ parlay::sequence<size_t> tstat_segmenter_t::segment_signal(const parlay::sequenc
     parlay::sequence<size_t> peaks;
     const int n_detectors = detectors.size();
     const auto s_len = signal.size();
-    auto [prefix_sum, prefix_sum_sq] = compute_prefix_prefixsq(signal);
-    for(auto &detector: detectors) {
+    u4 max_w = 0;
+    for (auto &detector: detectors) {
         detector.reset();
-        detector.tstat = compute_tstat(prefix_sum, prefix_sum_sq, detector.WINDOW_LENGTH);
+        max_w = max(max_w, detector.WINDOW_LENGTH);
     }
+    expect(2 * max_w < SEG_RING_SIZE);
+
+    // prefix sums are computed just ahead of where the t-statistics are needed, into rings that hold the last few
+    double *ps = prefix_sum.data(), *pss = prefix_sum_sq.data();
+    ps[0] = pss[0] = 0;
+    size_t n_summed = 0;
 
     for (uint32_t i = 0; i < s_len; i++) {
+        for (const size_t end = min((size_t)i + max_w, s_len); n_summed < end; ++n_summed) {
+            const double x = signal[n_summed];
+            ps[(n_summed + 1) & SEG_RING_MASK] = ps[n_summed & SEG_RING_MASK] + x;
+            pss[(n_summed + 1) & SEG_RING_MASK] = pss[n_summed & SEG_RING_MASK] + x * x;
+        }
+
         for (uint32_t k = 0; k < n_detectors; k++) {
             auto &detector = detectors[k];
             if (detector.masked_to >= i) continue;
 
-            double current_value = detector.tstat[i];
+            double current_value = tstat_at(ps, pss, i, s_len, detector.WINDOW_LENGTH);
             // double adaptive_peak_height = calculate_adaptive_peak_height(prefix_sum, prefix_sum_square, i, detector->window_length, peak_height);
 
             if (detector.peak_pos == detector.DEF_PEAK_POS) {
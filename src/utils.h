@@ -6,7 +6,9 @@
 #define COLLINEARITY_UTILS_H
 
 #include "prelude.h"
+#include "kmers.h"
 #include <sys/resource.h>
+#include <string_view>
 
 #define LOW32(x) ((x) & 0xffffffff)
 #define HIGH32(x) (((x)>>32) & 0xffffffff)
@@ -51,34 +53,86 @@ static inline  size_t lower_bound(const T *arr, size_t start, size_t end, const
 }
 
 template <typename T, typename Encoder>
-static inline u4 encode_kmer(const T& seq, int k, int sigma, Encoder encoder) {
+static inline kmer_t encode_kmer(const T& seq, int k, int sigma, Encoder encoder) {
     u8 v = 0;
     for (u4 i = 0; i < k; ++i) v = v * sigma + encoder(seq[i]);
     return v;
 }
 
+/**
+ * Sequences of DNA characters that are stored contiguously and can be encoded by `encode_dna_kmers`
+ */
+template <typename T> struct is_dna_buffer : std::false_type {};
+template <> struct is_dna_buffer<std::string> : std::true_type {};
+template <> struct is_dna_buffer<parlay::sequence<char>> : std::true_type {};
+template <> struct is_dna_buffer<parlay::slice<char*, char*>> : std::true_type {};
+template <> struct is_dna_buffer<parlay::slice<const char*, const char*>> : std::true_type {};
+template <> struct is_dna_buffer<std::string_view> : std::true_type {};
+
+template <typename T, typename Encoder>
+static constexpr bool use_dna_kernel() {
+    return is_dna_buffer<T>::value && std::is_same_v<Encoder, std::decay_t<decltype(encode_dna)>>;
+}
+
+#define KMER_CHUNKSZ (1<<16)
+
 template <typename T, typename Encoder>
-static inline parlay::sequence<u4> create_kmers(const T& sequence, int k, int sigma, Encoder encoder) {
+static inline parlay::sequence<kmer_t> create_kmers(const T& sequence, int k, int sigma, Encoder encoder) {
     size_t n = sequence.size();
     if (k > n) return {};
+    if constexpr (use_dna_kernel<T, Encoder>()) if (sigma == 4) {
+        const size_t n_kmers = n - k + 1;
+        parlay::sequence<kmer_t> keys = parlay::sequence<kmer_t>::uninitialized(n_kmers);
+        parlay::parallel_for(0, (n_kmers + KMER_CHUNKSZ - 1) / KMER_CHUNKSZ, [&](size_t c) {
+            const size_t start = c * KMER_CHUNKSZ, end = std::min(start + KMER_CHUNKSZ, n_kmers);
+            encode_dna_kmers(&sequence[start], end - start + k - 1, k, keys.data() + start);
+        }, 1);
+        return keys;
+    }
     return parlay::tabulate(n - k + 1, [&](size_t i){
         return encode_kmer(sequence.begin() + i, k, sigma, encoder);
     });
 }
 
+/**
+ * Encode the k-mers of a sequence one after the other
+ * @param keys room for the n - k + 1 k-mers of the sequence
+ */
 template <typename T, typename Encoder>
-static inline parlay::sequence<u4> create_kmers_1t(const T& sequence, int k, int sigma, Encoder encoder) {
+static inline void encode_kmers_1t(const T& sequence, int k, int sigma, Encoder encoder, kmer_t *keys) {
     const u8 M = ipow(sigma, k-1);
-    const u4 n = sequence.size(), n_keys = n - k + 1;
-    expect(n > k);
-    parlay::sequence<u4> keys(n_keys);
+    const u4 n = sequence.size();
+    if constexpr (use_dna_kernel<T, Encoder>()) if (sigma == 4) {
+        encode_dna_kmers(&sequence[0], n, k, keys);
+        return;
+    }
     keys[0] = encode_kmer(sequence, k, sigma, encoder);
     for (u4 i = k, j = 1; i < n; ++i, ++j) {
         keys[j] = (keys[j-1] - encoder(sequence[j-1]) * M) * sigma + encoder(sequence[i]);
     }
+}
+
+template <typename T, typename Encoder>
+static inline parlay::sequence<kmer_t> create_kmers_1t(const T& sequence, int k, int sigma, Encoder encoder) {
+    const u4 n = sequence.size(), n_keys = n - k + 1;
+    expect(n > k);
+    parlay::sequence<kmer_t> keys(n_keys);
+    encode_kmers_1t(sequence, k, sigma, encoder, keys.data());
     return keys;
 }
 
+/**
+ * Like `create_kmers_1t`, but into a buffer that is reused across calls, so it does not allocate once the buffer has
+ * grown to fit the longest sequence
+ */
+template <typename T, typename Encoder>
+static inline void create_kmers_1t(const T& sequence, int k, int sigma, Encoder encoder, std::vector<kmer_t> &keys) {
+    const u4 n = sequence.size();
+    expect(n > k);
+    keys.resize(n - k + 1);
+    encode_kmers_1t(sequence, k, sigma, encoder, keys.data());
+}
+
 static inline parlay::sequence<char> revcmp(std::string &seq) {
     const auto n = seq.size();
     parlay::sequence<char> revseq(n);
@@ -86,6 +140,29 @@ static inline parlay::sequence<char> revcmp(std::string &seq) {
     return revseq;
 }
 
+/**
+ * Encode the k-mers of a DNA sequence and of its reverse complement in one pass, into buffers that are reused across
+ * calls
+ * @param rc_keys k-mers of the reverse complement, in the order in which they occur in it
+ */
+template <typename T>
+static inline void create_kmers_both_1t(const T& sequence, int k, std::vector<kmer_t> &keys, std::vector<kmer_t> &rc_keys) {
+    static_assert(is_dna_buffer<T>::value, "not a DNA buffer");
+    const size_t n = sequence.size();
+    expect(n > k);
+    keys.resize(n - k + 1), rc_keys.resize(n - k + 1);
+    encode_dna_kmers(&sequence[0], n, k, keys.data(), rc_keys.data());
+    std::reverse(rc_keys.begin(), rc_keys.end());
+}
+
+/**
+ * Reverse complement a sequence into a buffer that is reused across calls
+ */
+static inline void revcmp(const char *seq, size_t n, std::string &out) {
+    out.resize(n);
+    for (size_t i = 0; i < n; ++i) out[i] = "TGAC"[(seq[n-1-i] >> 1) & 3];
+}
+
 static inline parlay::sequence<char> revcmp_par(std::string &seq) {
     const auto n = seq.size();
     return parlay::tabulate(n, [&](size_t i){
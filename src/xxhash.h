@@ -37,6 +37,7 @@
 #define COLLINEARITY_XXHASH_H
 
 #include <stdint.h>
+#include <string.h>
 typedef uint64_t U64;
 
 static const U64 PRIME64_1 = 11400714785074694791ULL;
@@ -55,7 +56,7 @@ static U64 XXH64_round(U64 acc, U64 input)
     return acc;
 }
 
-unsigned long long XXH64_hash64(unsigned long long x, unsigned long long seed) {
+static inline unsigned long long XXH64_hash64(unsigned long long x, unsigned long long seed) {
     U64 h64 = seed + PRIME64_5;
     h64 += (U64) 8;
     U64 const k1 = XXH64_round(0, x);
@@ -70,4 +71,72 @@ unsigned long long XXH64_hash64(unsigned long long x, unsigned long long seed) {
     return h64;
 }
 
+static inline U64 XXH_read64(const void *p) { U64 v; memcpy(&v, p, sizeof(v)); return v; }
+static inline uint32_t XXH_read32(const void *p) { uint32_t v; memcpy(&v, p, sizeof(v)); return v; }
+
+static U64 XXH64_mergeRound(U64 acc, U64 val)
+{
+    val  = XXH64_round(0, val);
+    acc ^= val;
+    acc  = acc * PRIME64_1 + PRIME64_4;
+    return acc;
+}
+
+static U64 XXH64(const void *input, size_t len, U64 seed)
+{
+    const uint8_t *p = (const uint8_t*)input;
+    const uint8_t *const bEnd = p + len;
+    U64 h64;
+
+    if (len >= 32) {
+        const uint8_t *const limit = bEnd - 32;
+        U64 v1 = seed + PRIME64_1 + PRIME64_2;
+        U64 v2 = seed + PRIME64_2;
+        U64 v3 = seed + 0;
+        U64 v4 = seed - PRIME64_1;
+
+        do {
+            v1 = XXH64_round(v1, XXH_read64(p)); p+=8;
+            v2 = XXH64_round(v2, XXH_read64(p)); p+=8;
+            v3 = XXH64_round(v3, XXH_read64(p)); p+=8;
+            v4 = XXH64_round(v4, XXH_read64(p)); p+=8;
+        } while (p<=limit);
+
+        h64 = XXH_rotl64(v1, 1) + XXH_rotl64(v2, 7) + XXH_rotl64(v3, 12) + XXH_rotl64(v4, 18);
+        h64 = XXH64_mergeRound(h64, v1);
+        h64 = XXH64_mergeRound(h64, v2);
+        h64 = XXH64_mergeRound(h64, v3);
+        h64 = XXH64_mergeRound(h64, v4);
+    } else {
+        h64  = seed + PRIME64_5;
+    }
+
+    h64 += (U64) len;
+
+    while (p+8<=bEnd) {
+        U64 const k1 = XXH64_round(0, XXH_read64(p));
+        h64 ^= k1;
+        h64  = XXH_rotl64(h64,27) * PRIME64_1 + PRIME64_4;
+        p+=8;
+    }
+    if (p+4<=bEnd) {
+        h64 ^= (U64)(XXH_read32(p)) * PRIME64_1;
+        h64 = XXH_rotl64(h64, 23) * PRIME64_2 + PRIME64_3;
+        p+=4;
+    }
+    while (p<bEnd) {
+        h64 ^= (*p) * PRIME64_5;
+        h64 = XXH_rotl64(h64, 11) * PRIME64_1;
+        p++;
+    }
+
+    h64 ^= h64 >> 33;
+    h64 *= PRIME64_2;
+    h64 ^= h64 >> 29;
+    h64 *= PRIME64_3;
+    h64 ^= h64 >> 32;
+
+    return h64;
+}
+
 #endif //COLLINEARITY_XXHASH_H